@@ -31,4 +31,5 @@ public:
 	bool act();
 
 	const std::string& get_param(const std::string& name) const;
+	bool is_set(const std::string& name) const;
 };
@@ -23,11 +23,20 @@ class synthesizer;
 
 class config
 {
+public:
+	enum class MULTIPLICATION
+	{
+		SHIFT_AND_ADD,
+		QUARTER_SQUARE
+	};
+
+private:
 	const char endline = '\n';
 	std::string indentation = "    ";
 	std::shared_ptr<number_type_base> number_type;
 	std::shared_ptr<runtime_base> runtime_type;
 	const token_provider& tp;
+	MULTIPLICATION multiplication = MULTIPLICATION::SHIFT_AND_ADD;
 
 public:
 	explicit config(const token_provider& _tp);
@@ -38,4 +47,7 @@ public:
 	void set_number_interpretation(const std::string& ni, synthesizer& s);
 	std::shared_ptr<number_type_base> get_number_interpretation() const;
 	std::shared_ptr<runtime_base> get_runtime() const;
+
+	void set_multiplication(const std::string& m);
+	MULTIPLICATION get_multiplication() const;
 };
@@ -0,0 +1,54 @@
+/*
+ *
+ * Turbo Basic Compiler by mgr_inz_rafal.
+ *
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <rchabowski@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ *														// mgr inz. Rafal
+ * ----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <vector>
+
+// Evaluates integer expressions built of literals at compile time.
+// Literals are held back here instead of being put on the expression
+// stack, so that an operation on two of them can be replaced with its result.
+class constant_folder
+{
+public:
+	enum class OPERATION
+	{
+		ADDITION,
+		SUBTRACTION,
+		MULTIPLICATION,
+		DIVISION,
+		COMPARE_EQUAL,
+		COMPARE_NOT_EQUAL,
+		COMPARE_LESS,
+		COMPARE_LESS_EQUAL,
+		COMPARE_GREATER,
+		COMPARE_GREATER_EQUAL,
+		LOGICAL_AND,
+		LOGICAL_OR,
+		LOGICAL_NOT,
+		BINARY_XOR,
+		BINARY_AND,
+		BINARY_OR
+	};
+
+private:
+	std::vector<int> pending;
+
+	static int word(int value);
+	static int evaluate(OPERATION operation, int left, int right);
+
+public:
+	void push(int value);
+	bool fold(OPERATION operation);
+	bool has_pending() const;
+	std::vector<int> take_pending();
+};
@@ -15,23 +15,26 @@
 #include <set>
 #include <map>
 #include <stack>
+#include <vector>
 
 #include "config.h"
 #include "synthesizer.h"
 #include "token_provider.h"
 #include "stack.h"
 #include "basic_array.h"
+#include "operand.h"
 
 class generator
 {
 public:
-	enum class STACK
+	enum class COMPARISON
 	{
-		EXPRESSION,
-		FOR_CONDITION,
-		FOR_COUNTER,
-		RETURN_ADDRESS_STACK,
-		FOR_STEP
+		EQUAL,
+		NOT_EQUAL,
+		LESS,
+		LESS_EQUAL,
+		GREATER,
+		GREATER_EQUAL
 	};
 
 	enum class LOOP_CONTEXT
@@ -46,13 +49,29 @@ public:
 private:
 	const config& cfg;
 
-	const int EXPRESSION_STACK_CAPACITY = 64;
-	const int RETURN_ADDRESS_STACK_CAPACITY = 64;
-	const int FOR_LOOP_STACK_CAPACITY = 16;
+	// Expression stack is as deep as the first pass found the program
+	// needs, which may not exceed the zero page put aside for it
+	const int EXPRESSION_STACK_CAPACITY;
+	int expression_stack_depth = 0;
+
+	// Frames of dynamic FOR loops form a ring, so that those left by
+	// GOTO are overwritten eventually. Capacity is a power of two.
+	const int FOR_FRAMES_CAPACITY = 16;
+	const int FOR_FRAME_SIZE = 8;
+	const std::size_t MAX_BITS_IN_INLINED_FACTOR = 4;
 
 	const int ZERO_PAGE_START = 0x80;
+	const std::size_t MAX_ROW_TABLE_SIZE = 256;
+
+	// Compiler's own .zpvars are placed right after the zero page
+	// stack. The rest, up to the bytes reserved at $D2 and the
+	// floating point area at $D4, holds the most used variables.
+	// Assembler checks the .zpvars do fit in the room left for them.
+	const int ZERO_PAGE_COMPILER_VARIABLES_SIZE = 8;
+	const int ZERO_PAGE_VARIABLES_END = 0xD2;
+	const long LOOP_NESTING_WEIGHT = 16;
+	const std::size_t MAX_WEIGHTED_LOOP_NESTING = 4;
 	const int PROGRAM_START = 0x2000;
-	const int POINTER_SIZE = 2;
 	const std::map<std::string, int> ATARI_REGISTERS = {
 		{ "RUNAD",		0x02E0 },
 		{ "FR0",		0x00D4 },
@@ -76,28 +95,12 @@ private:
 		{ "EOL",		0x009B }
 	};
 
-	const std::map<STACK, stack> stacks = {
-		{ STACK::EXPRESSION, stack(
-			token(token_provider::TOKENS::EXPRESSION_STACK),
-			cfg.get_number_interpretation()->get_size(),
-			EXPRESSION_STACK_CAPACITY) },
-		{ STACK::FOR_CONDITION, stack(
-			token(token_provider::TOKENS::FOR_CONDITION_STACK),
-			POINTER_SIZE,
-			FOR_LOOP_STACK_CAPACITY) },
-		{ STACK::FOR_COUNTER, stack(
-			token(token_provider::TOKENS::FOR_COUNTER_STACK),
-			POINTER_SIZE,
-			FOR_LOOP_STACK_CAPACITY) },
-		{ STACK::RETURN_ADDRESS_STACK, stack(
-			token(token_provider::TOKENS::RETURN_ADDRESS_STACK),
-			POINTER_SIZE,
-			RETURN_ADDRESS_STACK_CAPACITY) },
-		{ STACK::FOR_STEP, stack(
-			token(token_provider::TOKENS::FOR_STEP_STACK),
-			POINTER_SIZE,
-			FOR_LOOP_STACK_CAPACITY) }
-	};
+	const stack expression_stack = stack(
+		token(token_provider::TOKENS::EXPRESSION_STACK),
+		token(token_provider::TOKENS::EXPRESSION_STACK_LO),
+		token(token_provider::TOKENS::EXPRESSION_STACK_HI),
+		EXPRESSION_STACK_CAPACITY,
+		ZERO_PAGE_START);
 
 	///////////////////////////////////////////////////////////////////////////////////////////
 	// TODO: Rework as loop control structures. Currently each
@@ -122,107 +125,316 @@ private:
 	int counter_do = 0;
 	std::stack<int> stack_do;	
 
+	// Value linear in the counter of the innermost FOR loop:
+	// coefficient * counter + invariant_coefficient * invariant + base + offset
+	struct induction
+	{
+		std::string counter;
+		int coefficient;
+		std::string invariant;
+		int invariant_coefficient;
+		std::string base;
+		int offset;
+	};
+
+	// Loop with step 1 whose body is a single store of a loop invariant,
+	// or of an element read through another induction slot, to memory
+	// addressed by an induction slot is a block fill or copy
+	struct block_operation
+	{
+		int statements = -1;
+		int stores = 0;
+		bool branches = false;
+		std::string destination;
+		std::string source;
+		operand value = operand(operand::PLACE::IMMEDIATE, "0");
+		int size = 0;
+	};
+
+	// FOR support structures. Limit and step are either
+	// immediates or live in slots owned by the particular loop.
+	// Induction values used in the body of a loop with constant step
+	// live in slots stepped along with the counter, as long as nothing
+	// in the body assigns to what they depend on.
+	// Loop whose body may be left by GOTO or GOSUB, entered by a jump,
+	// or which may run again before it ends, is dynamic. It keeps its
+	// state in a frame on the runtime FOR stack, where NEXT not matched
+	// with any FOR at compile time finds it as well.
+	struct for_scope
+	{
+		std::string procedure;
+		bool escapes;
+		std::set<std::string> calls;
+		std::set<int> lines;
+	};
+	struct for_loop
+	{
+		int id;
+		std::string counter;
+		operand limit;
+		operand step;
+		bool inductive;
+		std::vector<std::pair<std::string, induction>> induction_slots;
+		std::set<std::string> assigned;
+		bool calls;
+		block_operation block;
+		bool dynamic;
+		for_scope scope;
+	};
+	int counter_for = 0;
+	std::stack<for_loop> stack_for;
+	std::vector<std::string> for_loop_slots;
+	std::map<int, for_scope> for_scopes;
+	std::set<int> dynamic_loops;
+	bool for_frames_used = false;
+
+	// Value range analysis. What gets assigned to each variable is
+	// collected while generating code, so that after a first pass over
+	// the program the second one knows which variables stay in 0..255.
+	// Those keep the high byte zero and get 8-bit code where it pays off.
+	const int BYTE_MAXIMUM = 0xFF;
+	struct assignments
+	{
+		int maximum = 0;
+		int step = 0;
+		bool unbounded = false;
+		std::set<std::string> sources;
+	};
+	std::map<std::string, assignments> assigned;
+	std::set<std::string> byte_variables;
+
+	// AND/OR support structures. Operation is pending after its
+	// right operand has been parsed, until that operand is branched on.
+	// Operations pending together are nested in each other's right operand.
+	struct short_circuit
+	{
+		std::string label;
+		bool is_and;
+	};
+	std::stack<short_circuit> stack_short_circuit;
+	std::vector<short_circuit> pending_short_circuits;
+
 	// PROC support structures
 	std::stack<std::string> stack_procedure;
 
+	// Storage overlap. A variable used only inside one PROC, which
+	// every call assigns before reading, does not keep its value between
+	// calls. Such variables of PROCs which are never active at the same
+	// time share storage. PROC entered other way than by EXEC, or left
+	// other way than by ENDPROC, keeps its variables to itself.
+	struct procedure_scope
+	{
+		bool overlappable = true;
+		bool subroutines = false;
+		std::set<std::string> calls;
+		std::set<int> lines;
+	};
+	struct variable_scope
+	{
+		std::string procedure;
+		bool local;
+	};
+	std::map<std::string, procedure_scope> procedures;
+	std::map<std::string, variable_scope> variable_scopes;
+	std::set<int> jump_targets;
+	std::size_t procedure_nesting = 0;
+	int current_line = 0;
+	bool statement_terminates = false;
+	bool previous_statement_terminates = false;
+	std::map<std::string, std::string> shared_storage;
+
 	// Other support structures
 	int counter_generic_label = 0;
 	std::stack<LOOP_CONTEXT> loop_context;
 	///////////////////////////////////////////////////////////////////////////////////////////
 
+	// Compile-time view of the expression stack. Values are kept in FR0,
+	// in variables or as immediates for as long as possible and only
+	// reach the runtime stack when something needs them there.
+	std::vector<operand> operands;
+	std::vector<induction> inductions;
+
 	char E_;
-	std::set<std::string> integers;
 	std::set<std::string> variables;
+	std::map<std::string, basic_array> arrays;
+	std::map<std::string, long> usage_weights;
 	bool pokey_initialized;
 
 	synthesizer synth;
 
 	void write_code_header() const;
 	void write_code_footer();
-	void register_generator_runtime() const;
+	void write_uninitialized_data();
+	void write_uninitialized_data_clearing() const;
 
-	void write_stacks_initialization() const;
-	void write_stacks() const;
-	void write_integers();
-	void write_variables();
+	void write_stack_initialization() const;
+	void write_zero_page_stack() const;
+	int get_zero_page_stack_end() const;
+	int get_zero_page_variables_start() const;
+	void write_zero_page_guard() const;
+	void write_variables(const std::map<std::string, int>& zero_page);
+	void write_for_loop_slots(const std::map<std::string, int>& zero_page);
+	void write_zero_page_variables_initialization() const;
+	std::map<std::string, int> allocate_zero_page() const;
+	void note_use(const std::string& label);
+	void write_variable(const std::string& label, const std::map<std::string, int>& zero_page) const;
 	void write_atari_registers() const;
 	void write_atari_constants() const;
-	void write_internal_variables() const;
 	void write_run_segment() const;
 
 	void write_runtime() const;
 
-	void spawn_compiler_variable(const std::string& name, bool zero_page) const;
-	void init_pointer(const std::string& name, const std::string& source) const;
+	void push_bytes(const std::string& low, const std::string& high) const;
+	void note_stack_depth();
+	operand take_operand();
+	void load_operand(const operand& o, const std::string& target) const;
+	void flush_operands(std::size_t count);
+	void flush_operands();
+	void release_FR0();
+	void drop_operands(int count);
+	void combine_operands(const std::string& routine, const std::string& prologue, const std::string& instruction, bool commutative);
+	std::string get_operand_byte(const operand& o, int which, int slot = -1) const;
+	void compare_words(const std::string& left_low, const std::string& left_high, const std::string& right_low, const std::string& right_high);
+	static bool holds(const COMPARISON& c, int left, int right);
+	void branch_always(bool taken, const std::string& target);
+	void branch_on(const COMPARISON& c, bool outcome, const std::string& target);
+	void branch_on(bool outcome, const std::string& target);
+	void resolve_short_circuit(bool outcome, const std::string& target);
+	void write_short_circuit_value(const std::string& on_false);
+	bool get_constant(const operand& o, int& value) const;
+	void load_operands_to_FR0_FR1(const operand& left, const operand& right);
+	bool to_induction(const operand& o, induction& d) const;
+	bool combine_inductions(const induction& a, const induction& b, int factor, induction& result) const;
+	bool fold_inductions(int sign);
+	void push_induction(const induction& d);
+	operand materialize(const operand& o);
+	void compute_induction(const induction& d, const std::string& target) const;
+	void add_multiple_of_FR1(const std::string& target, int factor) const;
+	bool inductions_valid(const for_loop& loop) const;
+	void note_block_store(const std::string& destination, const operand& value, int size);
+	bool is_block_operation(const for_loop& loop) const;
+	void write_block_operation(const for_loop& loop);
+	const induction* find_induction_slot(const for_loop& loop, const std::string& slot) const;
+	void shift_FR0_left(int bits) const;
+	void shift_FR0_right(int bits) const;
+	void multiply_FR0_by_constant(int value) const;
+	operand take_for_loop_parameter(const token_provider::TOKENS& slot_token);
+	std::string get_for_frame_field(int offset) const;
+	void push_for_frame(const for_loop& loop);
+	void next_for_frame();
+	void write_for_frames() const;
+	void read_port(const std::string& port);
+	void note_assignment(const std::string& target, const operand& value);
+	void note_loop_range(const for_loop& loop);
+	bool fits_in_byte(const operand& o) const;
+	std::string current_procedure() const;
+	std::size_t nesting() const;
+	void note_scope(const std::string& label, bool write);
+	std::set<std::string> reachable_procedures(const std::string& p) const;
+	std::string storage_of(const std::string& label) const;
+	void write_memory_map(const std::map<std::string, int>& zero_page) const;
+	void forget_unreferenced(const std::set<std::string>& referenced);
 
 	const std::string& token(const token_provider::TOKENS& token) const;
+	void call_runtime(const std::string& routine) const;
 	std::string get_next_generic_label();
 	std::string last_generic_label;
 	std::string get_array_token(const std::string& name) const;
+	std::string get_elements_token(const std::string& name) const;
+	bool get_constant_element(const basic_array& a, std::size_t depth, std::string& element) const;
+	std::string point_to_element(const basic_array& a);
+	int get_row_stride(const basic_array& a) const;
+	bool has_row_table(const basic_array& a) const;
+	void register_array_header(const basic_array& arr) const;
 
 public:
-	generator(std::ostream& _stream, const config& _cfg);
-	~generator();
+	static const int MAXIMUM_EXPRESSION_STACK_CAPACITY = 32;
+
+	generator(std::ostream& _stream, const config& _cfg, int expression_stack_capacity = MAXIMUM_EXPRESSION_STACK_CAPACITY);
+
+	// Program is finished first. Runtime and data follow once dead code
+	// is removed from it, only what the rest of the code refers to.
+	void finish_program();
+	void finish(const std::set<std::string>& referenced);
+
+	std::set<std::string> get_byte_variables() const;
+	void set_byte_variables(const std::set<std::string>& v);
+	std::map<std::string, std::string> get_shared_storage(const std::set<std::string>& byte_variables) const;
+	void set_shared_storage(const std::map<std::string, std::string>& s);
+	std::set<int> get_dynamic_loops() const;
+	void set_dynamic_loops(const std::set<int>& l);
+	int get_expression_stack_depth() const;
 
-	void new_integer(const std::string& i);
 	void new_variable(const std::string& v);
-	void new_line(const int& i) const;
-	void put_integer_on_stack(const std::string& i) const;
-	void pop_to(const std::string& target, const generator::STACK& stack = generator::STACK::EXPRESSION) const;
-	void pop_to_variable(const std::string& target) const;
-	void peek_to(const std::string& target, const generator::STACK& stack = generator::STACK::EXPRESSION) const;
-	void push_from(const std::string& source, const generator::STACK& stack = generator::STACK::EXPRESSION) const;
-	void push_from_variable(const std::string& source) const;
+	void new_line(const int& i);
+	void new_statement();
+	void discard_operands();
+	void put_integer_on_stack(const std::string& i);
+	void pop_to(const std::string& target);
+	void pop_to_variable(const std::string& target);
+	void push_from(const std::string& source);
+	void push_from_variable(const std::string& source);
 	void FP_to_ASCII() const;
 	void FR0_boolean_invert() const;
 	void init_print() const;
 	void print_LBUFF() const;
 	void print_newline() const;
 	void print_comma() const;
-	void goto_line(const int& i) const;
-	void gosub(const int& i) const;
-	void gosub(const std::string& s) const;
+	void goto_line(const int& i);
+	void gosub(const int& i);
+	void gosub(const std::string& s);
 	void sound();
-	void poke() const;
-	void dpoke() const;
-	void peek() const;
-	void dpeek() const;
-	void stick() const;
-	void strig() const;
+	void poke();
+	void dpoke();
+	void peek();
+	void dpeek();
+	void stick();
+	void strig();
 	void after_if();
 	void inside_if();
 	void skip_if_on_false();
+	void skip_if_on_false(const COMPARISON& c);
 	void for_loop_condition();
 	void for_loop_counter(const std::string& counting_variable);
-	void for_step(bool default_step = false) const;
+	void for_step(bool default_step = false);
 	void next();
 	void while_();
 	void while_condition();
+	void while_condition(const COMPARISON& c);
 	void wend();
 	void exit();
 	void repeat();
 	void until();
+	void until(const COMPARISON& c);
 	void do_();
 	void loop();
-	void return_() const;
+	void return_();
 	void proc(const std::string& s);
-	void end() const;
-	void init_integer_array(const basic_array& arr) const;
-	void put_zero_in_FR0() const;
-	void addition() const;
-	void subtraction() const;
-	void multiplication() const;
-	void division() const;
+	void endproc();
+	void end();
+	void init_integer_array(const basic_array& arr);
+	void put_zero_in_FR0();
+	void addition();
+	void subtraction();
+	void multiplication();
+	void division();
+	void compare(const COMPARISON& c);
+	static COMPARISON negate(const COMPARISON& c);
 	void compare_equal() const;
 	void compare_less() const;
 	void compare_greater() const;
-	void assign_to_array(const std::string& a) const;
-	void retrieve_from_array(const std::string& a) const;
-	void random() const;
+	void assign_to_array(const basic_array& a);
+	void retrieve_from_array(const basic_array& a);
+	void random();
 	void logical_and() const;
 	void logical_or() const;
-	void binary_xor() const;
-	void binary_and() const;
-	void binary_or() const;
+	void short_circuit(bool is_and);
+	void short_circuit(bool is_and, const COMPARISON& c);
+	void close_short_circuit();
+	void short_circuit_value();
+	void short_circuit_value(const COMPARISON& c);
+	void binary_xor();
+	void binary_and();
+	void binary_or();
 };
 
@@ -158,12 +158,18 @@ struct tbxl_grammar : qi::grammar<Iterator, Skipper>
 					boost::bind(&reactor::got_compare_less_equal, &r)
 				]
 			|
-				("AND" >> expr_terminals)
+				(qi::string("AND")
+					[
+						boost::bind(&reactor::got_logical_and_left, &r)
+					] >> expr_terminals)
 				[
 					boost::bind(&reactor::got_logical_and, &r)
 				]
 			|
-				("OR" >> expr_terminals)
+				(qi::string("OR")
+					[
+						boost::bind(&reactor::got_logical_or_left, &r)
+					] >> expr_terminals)
 				[
 					boost::bind(&reactor::got_logical_or, &r)
 				]
@@ -201,6 +207,14 @@ struct tbxl_grammar : qi::grammar<Iterator, Skipper>
 					boost::bind(&reactor::got_integer_array_to_assign, &r)
 				];
 
+		// Never matches, only cleans up after the array assignment
+		// attempted on any other command
+		abandoned_array_assignment = qi::eps
+				[
+					boost::bind(&reactor::got_abandoned_array_assignment, &r)
+				]
+				>> !qi::eps;
+
 		expr_array = (variable_name >> '(' >> expr
 				[
 					boost::bind(&reactor::got_integer_array_first_dimension, &r)
@@ -323,7 +337,10 @@ struct tbxl_grammar : qi::grammar<Iterator, Skipper>
 				boost::bind(&reactor::got_repeat, &r)
 			];
 
-		UNTIL = (qi::string("UNTIL") >> expr)
+		UNTIL = (qi::string("UNTIL")
+			[
+				boost::bind(&reactor::got_condition, &r)
+			] >> expr)
 			[
 				boost::bind(&reactor::got_until, &r)
 			];
@@ -338,7 +355,10 @@ struct tbxl_grammar : qi::grammar<Iterator, Skipper>
 				boost::bind(&reactor::got_loop, &r)
 			];
 
-		IF = (qi::string("IF") >> expr
+		IF = (qi::string("IF")
+			[
+				boost::bind(&reactor::got_condition, &r)
+			] >> expr
 			[
 				boost::bind(&reactor::got_if, &r)
 			]
@@ -437,6 +457,7 @@ struct tbxl_grammar : qi::grammar<Iterator, Skipper>
 		command =
 			(assignment)					|
 			(integer_array_assignment)		|
+			(abandoned_array_assignment)	|
 			(PRINT)							|
 			(SOUND)							|
 			(POKE)							|
@@ -475,6 +496,7 @@ struct tbxl_grammar : qi::grammar<Iterator, Skipper>
 	qi::rule<Iterator, std::string()> variable_name;
 	qi::rule<Iterator, Skipper> assignment;
 	qi::rule<Iterator, Skipper> integer_array_assignment;
+	qi::rule<Iterator, Skipper> abandoned_array_assignment;
 	qi::rule<Iterator, Skipper> command;
 	qi::rule<Iterator, Skipper> commands;
 	qi::rule<Iterator, Skipper> command_terminator;
@@ -0,0 +1,47 @@
+/*
+ *
+ * Turbo Basic Compiler by mgr_inz_rafal.
+ *
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <rchabowski@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ *														// mgr inz. Rafal
+ * ----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <string>
+
+// Compile-time view of a single value on the expression stack.
+// Only the values placed on STACK are physically present
+// on the runtime stack. INDUCTION values are described by
+// the generator and get a place once used. Results known
+// to fit in a byte (like PEEK) are marked as such.
+class operand
+{
+public:
+	enum class PLACE
+	{
+		STACK,
+		FR0,
+		VARIABLE,
+		IMMEDIATE,
+		INDUCTION
+	};
+
+private:
+	PLACE place;
+	std::string value;
+	bool byte;
+
+public:
+	operand(PLACE _place, const std::string& _value = "", bool _byte = false);
+	PLACE get_place() const;
+	const std::string& get_value() const;
+	bool is_on_stack() const;
+	bool is_in_FR0() const;
+	bool is_byte() const;
+	std::string get_byte(int which) const;
+};
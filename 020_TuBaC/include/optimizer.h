@@ -0,0 +1,110 @@
+/*
+ *
+ * Turbo Basic Compiler by mgr_inz_rafal.
+ *
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <rchabowski@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ *														// mgr inz. Rafal
+ * ----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <istream>
+#include <ostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "token_provider.h"
+
+// Passes over the generated assembler source that need the whole
+// program to be known. Lines are taken apart only as far as needed:
+// label in the first column, then mnemonic and operand.
+class optimizer
+{
+public:
+	// Pattern lines hold a mnemonic and an operand in which $1, $2...
+	// stand for any text, the same one wherever it appears in the rule.
+	// Replacement must not be longer than the pattern. When the rule
+	// changes the flags, the next instruction has to be one of those
+	// which set them again.
+	struct peephole_rule
+	{
+		std::string name;
+		std::vector<std::string> pattern;
+		std::vector<std::string> replacement;
+		std::set<std::string> followed_by;
+	};
+
+private:
+	struct line
+	{
+		std::string text;
+		std::string label;
+		std::string mnemonic;
+		std::string operand;
+		bool removed;
+	};
+
+	std::vector<line> lines;
+	std::map<std::string, std::size_t> labels;
+	std::map<std::string, std::string> aliases;
+	std::map<std::string, int> symbols;
+	std::vector<peephole_rule> peephole_rules;
+	const token_provider& tp;
+
+	// Longest loop test repeated at the bottom of a rotated loop
+	const std::size_t MAXIMUM_ROTATED_TEST = 32;
+
+	struct cost
+	{
+		int bytes;
+		int cycles;
+	};
+
+	// Hardware registers do not read back what was written to them
+	const int IO_START = 0xD000;
+	const int IO_END = 0xD7FF;
+
+	static line parse(const std::string& text);
+	static bool is_identifier(const std::string& s);
+	static bool is_jump(const std::string& mnemonic);
+	static bool is_branch(const std::string& mnemonic);
+	static std::string inverted_jump(const std::string& mnemonic);
+	static bool is_transparent(const line& l);
+	static bool is_number(const std::string& s, int& value);
+	static cost instruction_cost(const std::string& mnemonic, const std::string& operand);
+	static bool match_operand(const std::string& pattern, const std::string& text, std::map<std::string, std::string>& bindings);
+	static std::string substitute(const std::string& text, const std::map<std::string, std::string>& bindings);
+
+	void index_labels();
+	std::string resolve_alias(const std::string& label) const;
+	const line* first_instruction(const std::string& label) const;
+	std::string final_target(const std::string& label) const;
+	bool falls_through_to(std::size_t index, const std::string& label) const;
+	void set_instruction(line& l, const std::string& mnemonic, const std::string& operand);
+	void index_symbols();
+	bool rotate_loop(std::size_t back_jump, std::vector<line>& bottom) const;
+	std::vector<std::string> identifiers(const std::string& operand) const;
+	bool is_volatile(const std::string& operand) const;
+	std::vector<std::size_t> window(std::size_t index, std::size_t size) const;
+	bool match(const std::vector<std::size_t>& w, const peephole_rule& rule, std::map<std::string, std::string>& bindings) const;
+	cost apply(const std::vector<std::size_t>& w, const peephole_rule& rule, const std::map<std::string, std::string>& bindings);
+
+public:
+	optimizer(std::istream& in, const token_provider& tp);
+
+	void append(std::istream& in);
+	std::set<std::string> referenced() const;
+	void add_peephole_rule(const peephole_rule& rule);
+	void rotate_loops();
+	void remove_dead_code();
+	void thread_jumps();
+	void peephole(const std::string& selection);
+	void tail_calls();
+	void write(std::ostream& out) const;
+};
@@ -0,0 +1,61 @@
+/*
+ *
+ * Turbo Basic Compiler by mgr_inz_rafal.
+ *
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <rchabowski@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ *														// mgr inz. Rafal
+ * ----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "synthesizer.h"
+
+// Packs the executable assembled by MADS. Segments are compressed with
+// a byte oriented LZ scheme and unpacked by a routine run from INITAD,
+// before the program is started from RUNAD. Packed data is loaded right
+// after the program, where its uninitialized data is cleared later on.
+class packer
+{
+	struct segment
+	{
+		int start;
+		std::vector<unsigned char> data;
+	};
+
+	// Packed data is a list of segments, each being the target address
+	// followed by tokens and zero. Token below $80 is the count of literal
+	// bytes that follow it, otherwise it is a copy of the bytes already
+	// unpacked at the offset given by the next two bytes.
+	const std::size_t MINIMUM_MATCH = 4;
+	const std::size_t MAXIMUM_MATCH = 0x7F + MINIMUM_MATCH;
+	const std::size_t MAXIMUM_LITERALS = 0x7F;
+	const std::size_t MAXIMUM_CANDIDATES = 64;
+
+	// Vectors and zero page are loaded as they are
+	const int VECTORS_START = 0x2E0;
+	const int VECTORS_END = 0x2E3;
+	const int MEMORY_TOP = 0xBC00;
+
+	std::vector<segment> packed;
+	std::vector<segment> kept;
+	std::size_t raw_size;
+
+	char E_;
+	synthesizer& synth;
+
+	std::vector<unsigned char> compress(const std::vector<unsigned char>& data) const;
+	void synth_unpacker() const;
+	void synth_bytes(const std::vector<unsigned char>& bytes) const;
+
+public:
+	packer(const std::string& executable, synthesizer& _synth, char endline);
+
+	void write() const;
+};
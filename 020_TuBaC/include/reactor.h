@@ -14,7 +14,9 @@
 
 #include "generator.h"
 #include "context.h"
+#include "constant_folder.h"
 
+#include <stack>
 #include <string>
 
 class reactor
@@ -27,31 +29,58 @@ class reactor
 	bool recent_for_had_step;
 	bool last_printed_token_was_separator;
 
+	// Literals not yet handed over to the generator
+	constant_folder folder;
+
+	// Comparison held back until it is known whether
+	// its result is needed as a value or just for a branch
+	bool comparison_pending = false;
+	generator::COMPARISON pending_comparison;
+
+	// AND and OR in IF, WHILE and UNTIL conditions skip the right
+	// operand when the left one decides. Each operation remembers
+	// whether it does; the latest one stays pending until its
+	// result is branched on or needed as a value.
+	bool in_condition = false;
+	std::stack<bool> short_circuits;
+	bool short_circuit_pending = false;
+
+	generator& gen();
+	bool fold(constant_folder::OPERATION operation);
+	void defer_comparison(const generator::COMPARISON& c);
+	bool take_comparison(generator::COMPARISON& c);
+	generator& condition();
+	void start_logical_operation(bool is_and);
+	bool finish_logical_operation();
+
 public:
 	explicit reactor(generator& g);
 
 	void got_line_number(const int& i);
 	void got_command_separator();
-	void got_asterisk() const;
-	void got_slash() const;
-	void got_plus() const;
-	void got_minus() const;
-	void got_logical_and() const;
-	void got_logical_or() const;
-	void got_binary_xor() const;
-	void got_binary_and() const;
-	void got_binary_or() const;
-	void got_compare_equal() const;
-	void got_compare_not_equal() const;
-	void got_compare_less() const;
-	void got_compare_greater_equal() const;
-	void got_compare_greater() const;
-	void got_compare_less_equal() const;
-	void got_integer(int i) const;
+	void got_asterisk();
+	void got_slash();
+	void got_plus();
+	void got_minus();
+	void got_logical_and_left();
+	void got_logical_or_left();
+	void got_logical_and();
+	void got_logical_or();
+	void got_condition();
+	void got_binary_xor();
+	void got_binary_and();
+	void got_binary_or();
+	void got_compare_equal();
+	void got_compare_not_equal();
+	void got_compare_less();
+	void got_compare_greater_equal();
+	void got_compare_greater();
+	void got_compare_less_equal();
+	void got_integer(int i);
 	void got_print_expression();
-	void got_goto_integer(const int& i) const;
-	void got_gosub_integer(const int& i) const;
-	void got_sound() const;
+	void got_goto_integer(const int& i);
+	void got_gosub_integer(const int& i);
+	void got_sound();
 	void got_variable_to_assign(const std::string& s);
 	void got_integer_array_to_assign();
 	void got_integer_array_to_retrieve();
@@ -62,40 +91,41 @@ public:
 	void got_integer_array_size_2(int i);
 	void got_array_declaration();
 	void got_array_declaration_finished();
-	void got_variable_to_retrieve(const std::string& s) const;
-	void got_poke() const;
-	void got_dpoke() const;
-	void got_peek() const;
-	void got_dpeek() const;
-	void got_stick() const;
-	void got_strig() const;
+	void got_variable_to_retrieve(const std::string& s);
+	void got_poke();
+	void got_dpoke();
+	void got_peek();
+	void got_dpeek();
+	void got_stick();
+	void got_strig();
 	void got_for();
-	void got_to() const;
+	void got_to();
 	void got_step();
-	void got_after_for() const;
-	void got_next() const;
-	void got_if() const;
-	void got_else() const;
-	void got_endif() const;
-	void got_then() const;
-	void got_while() const;
-	void got_while_condition() const;
-	void got_wend() const;
-	void got_exit() const;
-	void got_repeat() const;
-	void got_until() const;
-	void got_do() const;
-	void got_loop() const;
-	void got_return() const;
-	void got_exec(const std::string& s) const;
-	void got_proc(const std::string& s) const;
-	void got_endproc() const;
-	void got_end() const;
+	void got_after_for();
+	void got_next();
+	void got_if();
+	void got_else();
+	void got_endif();
+	void got_then();
+	void got_while();
+	void got_while_condition();
+	void got_wend();
+	void got_exit();
+	void got_repeat();
+	void got_until();
+	void got_do();
+	void got_loop();
+	void got_return();
+	void got_exec(const std::string& s);
+	void got_proc(const std::string& s);
+	void got_endproc();
+	void got_end();
 	void got_separator_semicolon();
 	void got_separator_comma();
-	void got_after_print() const;
+	void got_after_print();
 	void got_print();
 	void got_execute_array_assignment();
-	void got_random() const;
-	void got_not() const;
+	void got_abandoned_array_assignment();
+	void got_random();
+	void got_not();
 };
@@ -14,6 +14,9 @@
 
 #include <string>
 #include <list>
+#include <map>
+#include <set>
+#include <vector>
 
 #include "synthesizer.h"
 #include "token_provider.h"
@@ -23,9 +26,26 @@ class config;
 class runtime_base
 {
 	std::list<std::string> own_functions;
+	std::set<std::string> used_routines;
 	void synth_own_functions() const;
 
 protected:
+	// Routines called from within other routines
+	std::map<std::string, std::vector<std::string>> dependencies = {
+		{ "PUTNEWLINE",			{ "PUTCHAR" } },
+		{ "PUTSPACE",			{ "PUTCHAR" } },
+		{ "PUTSTRING",			{ "PUTCHAR" } },
+		{ "PUTCOMMA",			{ "PUTSPACE" } },
+		{ "BLOCK_FILL",			{ "BLOCK_PARAMETERS" } },
+		{ "BLOCK_COPY",			{ "BLOCK_PARAMETERS" } }
+	};
+	bool is_used(const std::string& routine) const;
+
+	// Bytes of scratch memory needed by the routine. Routines having
+	// any never call each other, so all of them share one pool.
+	virtual int get_scratch_size(const std::string& routine) const;
+	void synth_scratch_pool() const;
+
 	char E_;
 	synthesizer& synth;
 	const config& cfg;
@@ -36,14 +56,6 @@ protected:
 	// *** rendering its data in correct places  ***
 
 	// Helpers
-	virtual void synth_INIT_PUSH_POP_POINTER() const;
-	virtual void synth_IsXY00() const;
-	virtual void synth_POP_TO() const;
-	virtual void synth_PEEK_TO() const;
-	virtual void synth_FAKE_POP() const;
-	virtual void synth_PUSH_FROM() const;
-	virtual void synth_INIT_ARRAY_OFFSET() const;
-	virtual void synth_CALCULATE_ARRAY_ROW_SIZE_IN_BYTES() const;
 	virtual void synth_helpers() const;
 
 	// Printing
@@ -62,11 +74,17 @@ protected:
 	virtual void synth_DPOKE() const;
 	virtual void synth_PEEK() const;
 	virtual void synth_DPEEK() const;
+	virtual void synth_BLOCK_PARAMETERS() const;
+	virtual void synth_BLOCK_FILL() const;
+	virtual void synth_BLOCK_COPY() const;
 
 	// Misc
 	virtual void synth_STICK() const;
 	virtual void synth_STRIG() const;
 
+	// Loops
+	virtual void synth_FOR_NEXT() const;
+
 	// *** These functions must be derived by each ***
 	// *** runtime implementation                  ***
 	virtual void synth_COMPARE_NUMBER() const = 0;
@@ -95,4 +113,6 @@ public:
 	runtime_base(char endline, synthesizer& _synth, const config& _tp);
 	virtual void synth_implementation() const = 0;
 	virtual void register_own_runtime_funtion(const std::string& body);
+	void use(const std::string& routine);
+	void retain(const std::set<std::string>& referenced);
 };
\ No newline at end of file
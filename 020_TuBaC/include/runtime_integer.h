@@ -19,10 +19,14 @@ class runtime_integer: public runtime_base
 	// Functions specific to integer runtime
 	void synth_BCDByte2Ascii() const;
 	void synth_INBUFP_INIT() const;
+	void synth_BMUL_shift_and_add() const;
+	void synth_BMUL_quarter_square() const;
+	void synth_stack_slots_operation(const std::string& name, const std::string& prologue, const std::string& instruction) const;
 
 protected:
 	// Override of the pure interface
 	void synth_implementation() const override;
+	int get_scratch_size(const std::string& routine) const override;
 	void synth_COMPARE_NUMBER() const override;
 	void synth_TRUE_FALSE() const override;
 	void synth_BADD() const override;
@@ -17,14 +17,22 @@
 class stack
 {
 	std::string name;
-	std::string pointer;
 	int item_size;
 	int capacity;
+
+	// Zero page stacks are split into separate low and high byte
+	// arrays that are indexed directly by the X register
+	int zero_page_address;
+	std::string low_bytes;
+	std::string high_bytes;
+
 public:
-	stack(const std::string& _name, int _item_size, int _capacity);
+	stack(const std::string& _name, const std::string& _low_bytes, const std::string& _high_bytes, int _capacity, int _zero_page_address);
 	const std::string& get_name() const;
-	const std::string& get_pointer() const;
 	int get_capacity() const;
 	int get_item_size() const;
+	int get_zero_page_address() const;
+	const std::string& get_low_bytes() const;
+	const std::string& get_high_bytes() const;
 };
 
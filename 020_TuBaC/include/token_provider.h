@@ -23,19 +23,8 @@ public:
 		PROGRAM_START,
 		PROGRAM_END,
 		EXPRESSION_STACK,
-		EXPRESSION_STACK_PTR,
-		RETURN_ADDRESS_STACK,
-		RETURN_ADDRESS_STACK_PTR,
-		FOR_CONDITION_STACK,
-		FOR_CONDITION_STACK_PTR,
-		FOR_COUNTER_STACK,
-		FOR_COUNTER_STACK_PTR,
-		FOR_STEP_STACK,
-		FOR_STEP_STACK_PTR,
-		INTEGER,
-		PUSH_POP_PTR_TO_INC_DEC,
-		PUSH_POP_VALUE_PTR,
-		PUSH_POP_TARGET_STACK_PTR,
+		EXPRESSION_STACK_LO,
+		EXPRESSION_STACK_HI,
 		LINE_INDICATOR,
 		VARIABLE,
 		AFTER_IF_INDICATOR,
@@ -43,12 +32,30 @@ public:
 		GENERIC_LABEL,
 		WHILE_INDICATOR,
 		AFTER_WHILE_INDICATOR,
+		WHILE_BODY_INDICATOR,
 		REPEAT_INDICATOR,
 		AFTER_REPEAT_INDICATOR,
 		DO_INDICATOR,
 		AFTER_DO_INDICATOR,
+		FOR_INDICATOR,
+		AFTER_FOR_INDICATOR,
+		FOR_LIMIT,
+		FOR_STEP,
+		FOR_INDUCTION,
+		FOR_INDUCTION_INIT,
+		FOR_INDUCTION_VALID,
+		FOR_BLOCK_OPERATION,
+		FOR_BLOCK_OPERATION_USED,
+		FOR_FRAMES,
+		FOR_FRAMES_TOP,
+		FOR_FRAMES_CAPACITY,
 		PROCEDURE,
-		INTEGER_ARRAY
+		INTEGER_ARRAY,
+		ZERO_PAGE_VARIABLES_INIT,
+		ZERO_PAGE_VARIABLES_GUARD,
+		BSS_START,
+		BSS_SIZE,
+		BSS_CLEAR
 	};
 
 private:
@@ -57,19 +64,8 @@ private:
 		{ TOKENS::PROGRAM_START,			make_token("PROGRAM_START") },
 		{ TOKENS::PROGRAM_END,				make_token("PROGRAM_ENDS_HERE") },
 		{ TOKENS::EXPRESSION_STACK,			make_token("EXPRESSION_STACK") },
-		{ TOKENS::EXPRESSION_STACK_PTR,		make_token("EXPRESSION_STACK_PTR") },
-		{ TOKENS::RETURN_ADDRESS_STACK,		make_token("RETURN_ADDRESS_STACK") },
-		{ TOKENS::RETURN_ADDRESS_STACK_PTR,	make_token("RETURN_ADDRESS_STACK_PTR") },
-		{ TOKENS::FOR_CONDITION_STACK,		make_token("FOR_CONDITION_STACK") },
-		{ TOKENS::FOR_CONDITION_STACK_PTR,	make_token("FOR_CONDITION_STACK_PTR") },
-		{ TOKENS::FOR_COUNTER_STACK,		make_token("FOR_COUNTER_STACK") },
-		{ TOKENS::FOR_COUNTER_STACK_PTR,	make_token("FOR_COUNTER_STACK_PTR") },
-		{ TOKENS::FOR_STEP_STACK,			make_token("FOR_STEP_STACK") },
-		{ TOKENS::FOR_STEP_STACK_PTR,		make_token("FOR_STEP_STACK_PTR") },
-		{ TOKENS::INTEGER,					make_token("INTEGER_") },
-		{ TOKENS::PUSH_POP_PTR_TO_INC_DEC,	make_token("PUSH_POP_PTR_TO_INC_DEC") },
-		{ TOKENS::PUSH_POP_VALUE_PTR,		make_token("PUSH_POP_VALUE_PTR") },
-		{ TOKENS::PUSH_POP_TARGET_STACK_PTR,make_token("PUSH_POP_TARGET_STACK_PTR") },
+		{ TOKENS::EXPRESSION_STACK_LO,		make_token("EXPRESSION_STACK_LO") },
+		{ TOKENS::EXPRESSION_STACK_HI,		make_token("EXPRESSION_STACK_HI") },
 		{ TOKENS::LINE_INDICATOR,			make_token("LINE_NUMBER__") },
 		{ TOKENS::VARIABLE,					make_token("VARIABLE_") },
 		{ TOKENS::AFTER_IF_INDICATOR,		make_token("AFTER_IF_") },
@@ -77,12 +73,30 @@ private:
 		{ TOKENS::GENERIC_LABEL,			make_token("GENERIC_LABEL_") },
 		{ TOKENS::WHILE_INDICATOR,			make_token("WHILE_INDICATOR_") },
 		{ TOKENS::AFTER_WHILE_INDICATOR,	make_token("AFTER_WHILE_INDICATOR_") },
+		{ TOKENS::WHILE_BODY_INDICATOR,		make_token("WHILE_BODY_INDICATOR_") },
 		{ TOKENS::REPEAT_INDICATOR,			make_token("REPEAT_INDICATOR_") },
 		{ TOKENS::AFTER_REPEAT_INDICATOR,	make_token("AFTER_REPEAT_INDICATOR_") },
 		{ TOKENS::DO_INDICATOR,				make_token("DO_INDICATOR_") },
 		{ TOKENS::AFTER_DO_INDICATOR,		make_token("AFTER_DO_INDICATOR_") },
+		{ TOKENS::FOR_INDICATOR,			make_token("FOR_INDICATOR_") },
+		{ TOKENS::AFTER_FOR_INDICATOR,		make_token("AFTER_FOR_INDICATOR_") },
+		{ TOKENS::FOR_LIMIT,				make_token("FOR_LIMIT_") },
+		{ TOKENS::FOR_STEP,					make_token("FOR_STEP_") },
+		{ TOKENS::FOR_INDUCTION,			make_token("FOR_INDUCTION_") },
+		{ TOKENS::FOR_INDUCTION_INIT,		make_token("FOR_INDUCTION_INIT_") },
+		{ TOKENS::FOR_INDUCTION_VALID,		make_token("FOR_INDUCTION_VALID_") },
+		{ TOKENS::FOR_BLOCK_OPERATION,		make_token("FOR_BLOCK_OPERATION_") },
+		{ TOKENS::FOR_BLOCK_OPERATION_USED,	make_token("FOR_BLOCK_OPERATION_USED_") },
+		{ TOKENS::FOR_FRAMES,				make_token("FOR_FRAMES") },
+		{ TOKENS::FOR_FRAMES_TOP,			make_token("FOR_FRAMES_TOP") },
+		{ TOKENS::FOR_FRAMES_CAPACITY,		make_token("FOR_FRAMES_CAPACITY") },
 		{ TOKENS::PROCEDURE,				make_token("PROCEDURE_") },
-		{ TOKENS::INTEGER_ARRAY,			make_token("INTEGER_ARRAY_") }
+		{ TOKENS::INTEGER_ARRAY,			make_token("INTEGER_ARRAY_") },
+		{ TOKENS::ZERO_PAGE_VARIABLES_INIT,	make_token("ZERO_PAGE_VARIABLES_INIT") },
+		{ TOKENS::ZERO_PAGE_VARIABLES_GUARD,make_token("ZERO_PAGE_VARIABLES_GUARD") },
+		{ TOKENS::BSS_START,				make_token("BSS_START") },
+		{ TOKENS::BSS_SIZE,					make_token("BSS_SIZE") },
+		{ TOKENS::BSS_CLEAR,				make_token("BSS_CLEAR_") }
 	};
 
 	std::string make_token(const std::string& name) const;
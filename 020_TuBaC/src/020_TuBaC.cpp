@@ -15,6 +15,9 @@
 #include <boost/algorithm/string/trim.hpp>
 
 #include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
 #include <string>
 #include <stdexcept>
 
@@ -23,6 +26,8 @@
 #include "grammar.h"
 #include "reactor.h"
 #include "generator.h"
+#include "optimizer.h"
+#include "packer.h"
 #include "synthesizer.h"
 #include "token_provider.h"
 
@@ -54,6 +59,72 @@ std::string read_file_to_string(const std::string& name)
 	return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
 }
 
+// What the first pass learns about the program
+struct variable_plan
+{
+	std::set<std::string> byte_variables;
+	std::map<std::string, std::string> shared_storage;
+	std::set<int> dynamic_loops;
+	int expression_stack_depth;
+};
+
+// Passes over the program, with the code and the messages thrown away.
+// The first one learns which variables never leave the range of a byte,
+// which can share storage and which FOR loops need a runtime frame, the
+// second one how deep the expression stack gets with all of that applied
+variable_plan plan_variables(const command_line& cl, const token_provider& tp, const std::string& program)
+{
+	std::ostream discard(nullptr);
+	config cfg(tp);
+	synthesizer s(discard, cfg.get_indent(), '\n');
+	cfg.set_number_interpretation(cl.get_param("number-type"), s);
+	cfg.set_multiplication(cl.get_param("multiplication"));
+
+	const auto messages = std::cout.rdbuf(nullptr);
+	try
+	{
+		variable_plan result;
+		{
+			generator gen(discard, cfg);
+			reactor r(gen);
+			grammar_t g(r);
+			test_parser(g, program);
+			result.byte_variables = gen.get_byte_variables();
+			result.shared_storage = gen.get_shared_storage(result.byte_variables);
+			result.dynamic_loops = gen.get_dynamic_loops();
+		}
+		{
+			generator gen(discard, cfg);
+			gen.set_byte_variables(result.byte_variables);
+			gen.set_shared_storage(result.shared_storage);
+			gen.set_dynamic_loops(result.dynamic_loops);
+			reactor r(gen);
+			grammar_t g(r);
+			test_parser(g, program);
+			result.expression_stack_depth = gen.get_expression_stack_depth();
+		}
+		std::cout.rdbuf(messages);
+		return result;
+	}
+	catch (...)
+	{
+		std::cout.rdbuf(messages);
+		throw;
+	}
+}
+
+// Writes the assembly of the packed version of an executable
+void pack_executable(const command_line& cl)
+{
+	const token_provider tp;
+	config cfg(tp);
+	std::ofstream out(cl.get_param("output-file"));
+	synthesizer s(out, cfg.get_indent(), cfg.get_endline());
+	std::cout << "Packing file '" << cl.get_param("input-file") << "' into '" << cl.get_param("output-file") << "'\n";
+	packer p(read_file_to_string(cl.get_param("input-file")), s, cfg.get_endline());
+	p.write();
+}
+
 int main(int argc, char **argv)
 {
 	try
@@ -63,27 +134,54 @@ int main(int argc, char **argv)
 		{
 			return 1;
 		}
+		if (cl.is_set("pack"))
+		{
+			pack_executable(cl);
+			return 0;
+		}
 
-		// Setup synthesizer
-		std::ofstream out;
+		// Setup synthesizer. Code is collected in memory
+		// and optimized once the whole program is known.
+		std::stringstream code;
 		const token_provider tp;
 		config cfg(tp);
-		synthesizer s(out, cfg.get_indent(), '\n');
+		synthesizer s(code, cfg.get_indent(), '\n');
 		cfg.set_number_interpretation(cl.get_param("number-type"), s);
+		cfg.set_multiplication(cl.get_param("multiplication"));
 
 		// Read input file
 		std::cout << "Compiling file '" << cl.get_param("input-file") << "' into '" << cl.get_param("output-file") << "'\n";
 		auto program = read_file_to_string(cl.get_param("input-file"));
 		boost::trim(program);
-
-		// Setup output file
-		out.open(cl.get_param("output-file"));
+		const auto plan = plan_variables(cl, tp, program);
 
 		// Generate
-		generator gen(out, cfg);
-		reactor r(gen);
-		grammar_t g(r);
-		return test_parser(g, program);
+		int result;
+		generator gen(code, cfg, plan.expression_stack_depth);
+		gen.set_byte_variables(plan.byte_variables);
+		gen.set_shared_storage(plan.shared_storage);
+		gen.set_dynamic_loops(plan.dynamic_loops);
+		{
+			reactor r(gen);
+			grammar_t g(r);
+			result = test_parser(g, program);
+		}
+		gen.finish_program();
+
+		// Runtime and data are generated once dead code is gone,
+		// then the whole of it is optimized and written to the output file
+		optimizer opt(code, tp);
+		opt.rotate_loops();
+		opt.remove_dead_code();
+		code.clear();
+		gen.finish(opt.referenced());
+		opt.append(code);
+		opt.thread_jumps();
+		opt.peephole(cl.get_param("peephole"));
+		opt.tail_calls();
+		std::ofstream out(cl.get_param("output-file"));
+		opt.write(out);
+		return result;
 	}
 	catch(const std::ifstream::failure& e)
 	{
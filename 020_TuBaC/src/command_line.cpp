@@ -43,6 +43,25 @@ command_line::command_line(int argc, char **argv)
 			"maximum compabibility but for the cost of lowest speed ")
 		("output-file,o", po::value<std::string>()->required(),
 			"Specify where the assembly file is created")
+		("multiplication,m", po::value<std::string>()->default_value("shift"),
+			"Selects the integer multiplication routine.\n\n"
+			"Values:\n"
+			"  shift: \tShift-and-add, at most 16 iterations "
+			"regardless of the operands\n"
+			"  table: \tQuarter-square multiplication using "
+			"lookup tables. Faster, but the tables take 1KB of RAM, plus up to 255 bytes of alignment")
+		("peephole,p", po::value<std::string>()->default_value("all"),
+			"Selects the peephole optimizer rules applied to the "
+			"generated assembly.\n\n"
+			"Values:\n"
+			"  all: \tAll rules\n"
+			"  none: \tPeephole optimizer is disabled\n"
+			"  comma separated rule names: \tstore-reload, "
+			"dead-load, repeated-store, push-pop")
+		("pack,k", "Takes the executable assembled by MADS as the "
+			"input file instead of a program, and creates the "
+			"assembly of its packed version, which unpacks itself "
+			"while loading")
 	;
 
 	all_options.add(options).add(hidden_options);
@@ -76,3 +95,8 @@ const std::string& command_line::get_param(const std::string& name) const
 {
 	return vm[name].as<std::string>();
 }
+
+bool command_line::is_set(const std::string& name) const
+{
+	return vm.count(name) > 0;
+}
@@ -63,6 +63,26 @@ std::shared_ptr<runtime_base> config::get_runtime() const
 	return runtime_type;
 }
 
+void config::set_multiplication(const std::string& m)
+{
+	if("shift" == m)
+	{
+		multiplication = MULTIPLICATION::SHIFT_AND_ADD;
+		return;
+	}
+	if("table" == m)
+	{
+		multiplication = MULTIPLICATION::QUARTER_SQUARE;
+		return;
+	}
+	throw std::invalid_argument("unknown multiplication method");
+}
+
+config::MULTIPLICATION config::get_multiplication() const
+{
+	return multiplication;
+}
+
 const token_provider& config::get_token_provider() const
 {
 	return tp;
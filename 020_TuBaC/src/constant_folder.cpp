@@ -0,0 +1,110 @@
+/*
+ *
+ * Turbo Basic Compiler by mgr_inz_rafal.
+ *
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <rchabowski@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ *														// mgr inz. Rafal
+ * ----------------------------------------------------------------------------
+ */
+
+#include "constant_folder.h"
+
+
+void constant_folder::push(int value)
+{
+	pending.push_back(value);
+}
+
+// Replaces topmost literals with the result of the operation. Returns false
+// when there are not enough literals, or when the result is better left to
+// the runtime (division by zero), so that the caller emits the code instead.
+bool constant_folder::fold(OPERATION operation)
+{
+	if (OPERATION::LOGICAL_NOT == operation)
+	{
+		if (pending.empty())
+		{
+			return false;
+		}
+		pending.back() = (0 == word(pending.back())) ? 1 : 0;
+		return true;
+	}
+
+	if (pending.size() < 2)
+	{
+		return false;
+	}
+	const int right = pending.back();
+	const int left = pending[pending.size() - 2];
+	if (OPERATION::DIVISION == operation && 0 == word(right))
+	{
+		return false;
+	}
+	pending.pop_back();
+	pending.back() = evaluate(operation, left, right);
+	return true;
+}
+
+bool constant_folder::has_pending() const
+{
+	return !pending.empty();
+}
+
+std::vector<int> constant_folder::take_pending()
+{
+	std::vector<int> taken;
+	taken.swap(pending);
+	return taken;
+}
+
+// Runtime operates on unsigned 16-bit words, so does the folder
+int constant_folder::word(int value)
+{
+	return value & 0xFFFF;
+}
+
+int constant_folder::evaluate(OPERATION operation, int left, int right)
+{
+	const int l = word(left);
+	const int r = word(right);
+	switch (operation)
+	{
+	case OPERATION::ADDITION:
+		return word(l + r);
+	case OPERATION::SUBTRACTION:
+		return word(l - r);
+	case OPERATION::MULTIPLICATION:
+		return word(static_cast<int>((static_cast<unsigned>(l) * static_cast<unsigned>(r)) & 0xFFFF));
+	case OPERATION::DIVISION:
+		return l / r;
+	case OPERATION::COMPARE_EQUAL:
+		return l == r;
+	case OPERATION::COMPARE_NOT_EQUAL:
+		return l != r;
+	case OPERATION::COMPARE_LESS:
+		return l < r;
+	case OPERATION::COMPARE_LESS_EQUAL:
+		return l <= r;
+	case OPERATION::COMPARE_GREATER:
+		return l > r;
+	case OPERATION::COMPARE_GREATER_EQUAL:
+		return l >= r;
+	case OPERATION::LOGICAL_AND:
+		return (l != 0) && (r != 0);
+	case OPERATION::LOGICAL_OR:
+		return (l != 0) || (r != 0);
+	case OPERATION::BINARY_XOR:
+		return l ^ r;
+	case OPERATION::BINARY_AND:
+		return l & r;
+	case OPERATION::BINARY_OR:
+		return l | r;
+	default:
+		break;
+	}
+	return 0;
+}
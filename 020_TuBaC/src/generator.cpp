@@ -14,13 +14,18 @@
 #include <boost/format.hpp>
 
 #include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <bitset>
+#include <stdexcept>
 
 #include "generator.h"
 #include "synthesizer.h"
 #include "algorithm.h"
 
-generator::generator(std::ostream& _stream, const config& _cfg):
+generator::generator(std::ostream& _stream, const config& _cfg, int expression_stack_capacity):
 	cfg(_cfg),
+	EXPRESSION_STACK_CAPACITY(std::max(expression_stack_capacity, 1)),
 	E_(cfg.get_endline()), 
 	pokey_initialized(false),
 	synth(_stream, _cfg.get_indent(), E_)
@@ -30,18 +35,75 @@ generator::generator(std::ostream& _stream, const config& _cfg):
 	write_atari_registers();
 	write_atari_constants();
 	write_code_header();
-	write_internal_variables();
-	
-	register_generator_runtime();
 }
 
-generator::~generator()
+void generator::finish_program()
 {
 	write_code_footer();
+}
+
+void generator::finish(const std::set<std::string>& referenced)
+{
+	forget_unreferenced(referenced);
+	for (const auto& a : arrays)
+	{
+		register_array_header(a.second);
+	}
+	cfg.get_runtime()->retain(referenced);
 	write_runtime();
+	write_uninitialized_data();
 	write_run_segment();
 }
 
+// Variables, FOR loop slots and frames, and arrays which only
+// the removed code used take no memory
+void generator::forget_unreferenced(const std::set<std::string>& referenced)
+{
+	const auto is_referenced = [&referenced](const std::string& label) {
+		return referenced.count(label) > 0;
+	};
+	std::set<std::string> storages;
+	for (const auto& v : variables)
+	{
+		const auto label = token(token_provider::TOKENS::VARIABLE) + v;
+		if (is_referenced(label))
+		{
+			storages.insert(storage_of(label));
+		}
+	}
+	for (auto it = variables.begin(); it != variables.end();)
+	{
+		const auto label = token(token_provider::TOKENS::VARIABLE) + *it;
+		if (is_referenced(label) || storages.count(label))
+		{
+			++it;
+			continue;
+		}
+		shared_storage.erase(label);
+		it = variables.erase(it);
+	}
+	for_loop_slots.erase(std::remove_if(for_loop_slots.begin(), for_loop_slots.end(), [&is_referenced](const std::string& slot) {
+		return !is_referenced(slot);
+	}), for_loop_slots.end());
+	for_frames_used = for_frames_used && (is_referenced(token(token_provider::TOKENS::FOR_FRAMES_TOP)) || is_referenced("FOR_NEXT"));
+	for (auto it = arrays.begin(); it != arrays.end();)
+	{
+		const auto name = get_array_token(it->first);
+		if (is_referenced(name) || is_referenced(get_elements_token(it->first)) || is_referenced(name + "_ROWS_LO") || is_referenced(name + "_ROWS_HI"))
+		{
+			++it;
+			continue;
+		}
+		it = arrays.erase(it);
+	}
+}
+
+void generator::call_runtime(const std::string& routine) const
+{
+	cfg.get_runtime()->use(routine);
+	synth.synth() << "jsr " << routine << E_;
+}
+
 const std::string& generator::token(const token_provider::TOKENS& token) const
 {
 	return cfg.get_token_provider().get(token);
@@ -50,31 +112,50 @@ const std::string& generator::token(const token_provider::TOKENS& token) const
 void generator::write_code_header() const {
 	synth.synth(false) << token(token_provider::TOKENS::PROGRAM_START) << " equ $" << std::hex << PROGRAM_START << std::dec << E_;
 	synth.synth() << "org " << token(token_provider::TOKENS::PROGRAM_START) << E_;
-	synth.synth(false) << ".zpvar = $" << std::hex << ZERO_PAGE_START << std::dec << E_;
+	write_zero_page_stack();
 	
 	synth.synth() << "mva #10 PTABW" << E_;
 
-	write_stacks_initialization();
+	write_uninitialized_data_clearing();
+	write_stack_initialization();
+	write_zero_page_variables_initialization();
 }
 
-void generator::write_stacks() const
+// Zero page stack is not part of the binary, it occupies the beginning
+// of the free zero page area and compiler variables are placed after it
+void generator::write_zero_page_stack() const
 {
-	for(const auto& s: stacks)
-	{
-		synth.synth() << "; STACK: " << s.second.get_name() << E_;
-		synth.synth(false) << s.second.get_name() << E_;
-		synth.synth(false) << ':' << s.second.get_capacity() << cfg.get_indent() << "dta ";
-		call_n(cfg.get_number_interpretation()->get_size()-1, [&]{synth.synth(false) << "b(0),";});
-		synth.synth(false) << "b(0)" << E_;
-	}
+	const auto& s = expression_stack;
+	const int address = s.get_zero_page_address();
+	synth.synth(false) << "; STACK: " << s.get_name() << " (zero page, indexed by X)" << E_;
+	synth.synth(false) << s.get_low_bytes() << " equ $" << std::hex << address << std::dec << E_;
+	synth.synth(false) << s.get_high_bytes() << " equ $" << std::hex << address + s.get_capacity() << std::dec << E_;
+	synth.synth(false) << ".zpvar = $" << std::hex << get_zero_page_stack_end() << std::dec << E_;
 }
 
-void generator::write_stacks_initialization() const {
-	for (const auto& s : stacks)
-	{
-		spawn_compiler_variable(s.second.get_pointer(), true);
-		init_pointer(s.second.get_pointer(), s.second.get_name());
-	}
+int generator::get_zero_page_stack_end() const
+{
+	return expression_stack.get_zero_page_address() + expression_stack.get_capacity() * expression_stack.get_item_size();
+}
+
+int generator::get_zero_page_variables_start() const
+{
+	return get_zero_page_stack_end() + ZERO_PAGE_COMPILER_VARIABLES_SIZE;
+}
+
+// Declared after the runtime, so it lands right after the last .zpvar
+void generator::write_zero_page_guard() const
+{
+	const auto& guard = token(token_provider::TOKENS::ZERO_PAGE_VARIABLES_GUARD);
+	synth.synth(false) << ".zpvar " << guard << " .byte" << E_;
+	synth.synth(false) << ".if " << guard << " > $" << std::hex << get_zero_page_variables_start() << std::dec << E_;
+	synth.synth() << ".error \"Compiler zero page variables overlap the program variables\"" << E_;
+	synth.synth(false) << ".endif" << E_;
+}
+
+void generator::write_stack_initialization() const {
+	synth.synth(false) << "; Init zero page stack '" << expression_stack.get_name() << "' (X is the stack pointer)" << E_;
+	synth.synth() << "ldx #0" << E_;
 }
 
 void generator::write_run_segment() const
@@ -89,47 +170,193 @@ void generator::write_code_footer()
 	// Infinite loop at the end so the processor
 	// won't fall into wilderness
 	synth.synth(false) << token(token_provider::TOKENS::PROGRAM_END) << " jmp " << token(token_provider::TOKENS::PROGRAM_END) << E_;
+}
+
+// Variables, FOR loop slots and frames, and array elements start as zeros,
+// so they only reserve memory after everything else and are not part
+// of the binary. Startup code clears them.
+void generator::write_uninitialized_data()
+{
+	write_zero_page_guard();
+	synth.synth(false) << "; Uninitialized data" << E_;
+	synth.synth(false) << token(token_provider::TOKENS::BSS_START) << E_;
+
+	const auto zero_page = allocate_zero_page();
+	write_memory_map(zero_page);
+	write_variables(zero_page);
+	write_for_loop_slots(zero_page);
+	write_for_frames();
+
+	synth.synth(false) << "; Array elements" << E_;
+	for (const auto& a : arrays)
+	{
+		const auto& arr = a.second;
+		synth.synth(false) << get_elements_token(arr.get_name()) << E_;
+		synth.synth() << ".ds " << (arr.get_size(0) + 1) * (arr.get_size(1) + 1) * cfg.get_number_interpretation()->get_size() << E_;
+	}
+	synth.synth(false) << token(token_provider::TOKENS::BSS_SIZE) << " equ *-" << token(token_provider::TOKENS::BSS_START) << E_;
+}
 
-	// Prepare internal data and structures
-	write_integers();
-	write_variables();
-	write_stacks();
+// Uninitialized data is cleared a page at a time,
+// then whatever is left of the last page
+void generator::write_uninitialized_data_clearing() const
+{
+	const auto start = token(token_provider::TOKENS::BSS_START);
+	const auto size = token(token_provider::TOKENS::BSS_SIZE);
+	const auto label = token(token_provider::TOKENS::BSS_CLEAR);
+	synth.synth(false) << "; Clear uninitialized data" << E_;
+	synth.synth() << "mwa #" << start << " ARRAY_ASSIGNMENT_TMP_ADDRESS" << E_;
+	synth.synth() << "lda #0" << E_;
+	synth.synth() << "tay" << E_;
+	synth.synth() << "ldx #>" << size << E_;
+	synth.synth() << "beq " << label << "REST" << E_;
+	synth.synth(false) << label << "PAGE" << E_;
+	synth.synth() << "sta (ARRAY_ASSIGNMENT_TMP_ADDRESS),y" << E_;
+	synth.synth() << "iny" << E_;
+	synth.synth() << "bne " << label << "PAGE" << E_;
+	synth.synth() << "inc ARRAY_ASSIGNMENT_TMP_ADDRESS+1" << E_;
+	synth.synth() << "dex" << E_;
+	synth.synth() << "bne " << label << "PAGE" << E_;
+	synth.synth(false) << label << "REST" << E_;
+	synth.synth() << "ldy #<" << size << E_;
+	synth.synth() << "beq " << label << "DONE" << E_;
+	synth.synth(false) << label << "LAST" << E_;
+	synth.synth() << "dey" << E_;
+	synth.synth() << "sta (ARRAY_ASSIGNMENT_TMP_ADDRESS),y" << E_;
+	synth.synth() << "bne " << label << "LAST" << E_;
+	synth.synth(false) << label << "DONE" << E_;
 }
 
-void generator::write_integers()
+void generator::write_variables(const std::map<std::string, int>& zero_page)
 {
-	synth.synth(false) << "; Fixed integers" << E_;
+	synth.synth(false) << "; Variables" << E_;
 
-	for (auto& i : integers)
+	for (auto& i : variables)
 	{
-		synth.synth(false) << token(token_provider::TOKENS::INTEGER);
-		if ('-' == i[0])
-		{
-			synth.synth(false) << "NEG_" << i.substr(1);
-		}
-		else
+		const auto label = token(token_provider::TOKENS::VARIABLE) + i;
+		if (storage_of(label) != label)
 		{
-			synth.synth(false) << i;
+			synth.synth(false) << label << " equ " << storage_of(label) << E_;
+			continue;
 		}
-		synth.synth(false) << E_;
-		synth.synth() << cfg.get_number_interpretation()->get_initializer(i) << E_;
+		write_variable(label, zero_page);
 	}
 }
 
-void generator::write_variables()
+void generator::write_for_loop_slots(const std::map<std::string, int>& zero_page)
 {
-	synth.synth(false) << "; Variables" << E_;
+	synth.synth(false) << "; FOR loop slots" << E_;
 
-	for (auto& i : variables)
+	for (auto& i : for_loop_slots)
+	{
+		write_variable(i, zero_page);
+	}
+}
+
+void generator::write_for_frames() const
+{
+	if (!for_frames_used)
+	{
+		return;
+	}
+	synth.synth(false) << "; FOR loop frames" << E_;
+	synth.synth(false) << token(token_provider::TOKENS::FOR_FRAMES_CAPACITY) << " equ " << FOR_FRAMES_CAPACITY << E_;
+	synth.synth(false) << token(token_provider::TOKENS::FOR_FRAMES_TOP) << E_;
+	synth.synth() << ".ds 1" << E_;
+	synth.synth(false) << token(token_provider::TOKENS::FOR_FRAMES) << E_;
+	synth.synth() << ".ds " << FOR_FRAMES_CAPACITY * FOR_FRAME_SIZE << E_;
+}
+
+void generator::write_variable(const std::string& label, const std::map<std::string, int>& zero_page) const
+{
+	const auto it = zero_page.find(label);
+	if (it != zero_page.end())
+	{
+		synth.synth(false) << label << " equ $" << std::hex << it->second << std::dec << E_;
+		return;
+	}
+	synth.synth(false) << label << E_;
+	synth.synth() << ".ds " << cfg.get_number_interpretation()->get_size() << E_;
+}
+
+// Each use of a variable counts the more the deeper in loops it is
+void generator::note_use(const std::string& label)
+{
+	long weight = 1;
+	for (std::size_t i = 1; i < std::min(loop_context.size(), MAX_WEIGHTED_LOOP_NESTING + 1); ++i)
+	{
+		weight *= LOOP_NESTING_WEIGHT;
+	}
+	usage_weights[label] += weight;
+}
+
+// Places variables and FOR loop slots with the highest usage weight on zero page
+std::map<std::string, int> generator::allocate_zero_page() const
+{
+	std::vector<std::string> candidates;
+	for (const auto& v : variables)
+	{
+		const auto label = token(token_provider::TOKENS::VARIABLE) + v;
+		if (storage_of(label) == label)
+		{
+			candidates.push_back(label);
+		}
+	}
+	candidates.insert(candidates.end(), for_loop_slots.begin(), for_loop_slots.end());
+
+	// Shared storage is used as much as all the variables in it
+	std::map<std::string, long> weights(usage_weights);
+	for (const auto& s : shared_storage)
 	{
-		synth.synth(false) << token(token_provider::TOKENS::VARIABLE) << i << E_;
-		synth.synth() << cfg.get_number_interpretation()->get_initializer() << E_;
+		const auto it = usage_weights.find(s.first);
+		if (it != usage_weights.end())
+		{
+			weights[s.second] += it->second;
+		}
+	}
+	const auto weight = [&weights](const std::string& label) {
+		const auto it = weights.find(label);
+		return (it == weights.end()) ? 0 : it->second;
+	};
+	std::stable_sort(candidates.begin(), candidates.end(), [&weight](const std::string& a, const std::string& b) {
+		return weight(a) > weight(b);
+	});
+
+	std::map<std::string, int> zero_page;
+	int address = get_zero_page_variables_start();
+	const auto size = cfg.get_number_interpretation()->get_size();
+	std::cout << std::endl << "*** ZERO PAGE ALLOCATION ***" << std::endl;
+	for (const auto& c : candidates)
+	{
+		if (address + size > ZERO_PAGE_VARIABLES_END)
+		{
+			std::cout << c << " -> RAM (weight " << weight(c) << ")" << std::endl;
+			continue;
+		}
+		zero_page[c] = address;
+		std::cout << c << " -> $" << std::hex << address << std::dec << " (weight " << weight(c) << ")" << std::endl;
+		synth.synth(false) << "; Zero page: " << c << " (weight " << weight(c) << ")" << E_;
+		address += size;
 	}
+	return zero_page;
 }
 
-void generator::new_integer(const std::string& i)
+// Variables on zero page are not part of the binary, so they are cleared here
+void generator::write_zero_page_variables_initialization() const
 {
-	integers.insert(i);
+	const auto label = token(token_provider::TOKENS::ZERO_PAGE_VARIABLES_INIT);
+	const auto start = get_zero_page_variables_start();
+	if (start >= ZERO_PAGE_VARIABLES_END)
+	{
+		return;
+	}
+	synth.synth(false) << "; Clear zero page variables" << E_;
+	synth.synth() << "lda #0" << E_;
+	synth.synth() << "ldy #" << (ZERO_PAGE_VARIABLES_END - start - 1) << E_;
+	synth.synth(false) << label << E_;
+	synth.synth() << "sta $" << std::hex << start << std::dec << ",y" << E_;
+	synth.synth() << "dey" << E_;
+	synth.synth() << "bpl " << label << E_;
 }
 
 void generator::new_variable(const std::string& v)
@@ -137,11 +364,300 @@ void generator::new_variable(const std::string& v)
 	variables.insert(v);
 }
 
-void generator::new_line(const int& i) const
+// Only values known to stay in a byte keep the variable narrow,
+// a copy of another variable depends on how that one is used
+void generator::note_assignment(const std::string& target, const operand& value)
+{
+	auto& a = assigned[target];
+	int constant;
+	if (get_constant(value, constant))
+	{
+		a.unbounded = a.unbounded || (constant > BYTE_MAXIMUM);
+		a.maximum = std::max(a.maximum, constant);
+		return;
+	}
+	switch (value.get_place())
+	{
+	case operand::PLACE::VARIABLE:
+		if (0 == value.get_value().find(token(token_provider::TOKENS::VARIABLE)))
+		{
+			a.sources.insert(value.get_value());
+			return;
+		}
+		break;
+	case operand::PLACE::INDUCTION:
+	{
+		const auto& d = inductions[std::stoi(value.get_value())];
+		if ((1 == d.coefficient) && d.invariant.empty() && d.base.empty() && (0 == d.offset))
+		{
+			a.sources.insert(d.counter);
+			return;
+		}
+		break;
+	}
+	default:
+		break;
+	}
+	a.unbounded = a.unbounded || !value.is_byte();
+}
+
+// Counter goes one step past the limit when the loop ends
+void generator::note_loop_range(const for_loop& loop)
+{
+	auto& a = assigned[loop.counter];
+	int limit;
+	int step;
+	if (!get_constant(loop.limit, limit) || !get_constant(loop.step, step) || (step < 1) || (step > BYTE_MAXIMUM))
+	{
+		a.unbounded = true;
+		return;
+	}
+	a.maximum = std::max(a.maximum, limit);
+	a.step = std::max(a.step, step);
+}
+
+bool generator::fits_in_byte(const operand& o) const
+{
+	int constant;
+	if (get_constant(o, constant))
+	{
+		return constant <= BYTE_MAXIMUM;
+	}
+	return o.is_byte() || ((operand::PLACE::VARIABLE == o.get_place()) && (byte_variables.count(o.get_value()) > 0));
+}
+
+// Variables never assigned anything wider than a byte. Copies are
+// only narrow as long as the source is, so those are dropped until
+// nothing changes.
+std::set<std::string> generator::get_byte_variables() const
+{
+	std::set<std::string> result;
+	for (const auto& v : variables)
+	{
+		const auto label = token(token_provider::TOKENS::VARIABLE) + v;
+		const auto it = assigned.find(label);
+		if (it == assigned.end())
+		{
+			result.insert(label);
+			continue;
+		}
+		const auto& a = it->second;
+		if (!a.unbounded && (a.maximum + a.step <= BYTE_MAXIMUM) && (a.sources.empty() || (0 == a.step)))
+		{
+			result.insert(label);
+		}
+	}
+	for (bool changed = true; changed;)
+	{
+		changed = false;
+		for (auto it = result.begin(); it != result.end();)
+		{
+			const auto a = assigned.find(*it);
+			const auto narrow = (a == assigned.end()) ||
+				std::all_of(a->second.sources.begin(), a->second.sources.end(), [&](const std::string& s) { return result.count(s) > 0; });
+			if (narrow)
+			{
+				++it;
+				continue;
+			}
+			it = result.erase(it);
+			changed = true;
+		}
+	}
+	return result;
+}
+
+void generator::set_byte_variables(const std::set<std::string>& v)
+{
+	byte_variables = v;
+}
+
+std::string generator::current_procedure() const
+{
+	return stack_procedure.empty() ? "" : stack_procedure.top();
+}
+
+// Depth of IFs and loops, zero at the top level
+std::size_t generator::nesting() const
+{
+	return stack_if.size() + loop_context.size() - 1;
+}
+
+// Variable is local when all its uses are in one PROC,
+// the first of them being an assignment every call makes
+void generator::note_scope(const std::string& label, bool write)
+{
+	const auto procedure = current_procedure();
+	const auto it = variable_scopes.find(label);
+	if (it == variable_scopes.end())
+	{
+		variable_scopes[label] = { procedure, !procedure.empty() && write && (nesting() == procedure_nesting) };
+		return;
+	}
+	if (it->second.procedure != procedure)
+	{
+		it->second.local = false;
+	}
+}
+
+// PROCs which can be active while the given one runs, or the other way
+// round. GOSUB may lead anywhere, so it makes every PROC reachable.
+std::set<std::string> generator::reachable_procedures(const std::string& p) const
+{
+	std::set<std::string> result;
+	std::vector<std::string> pending{ p };
+	while (!pending.empty())
+	{
+		const auto it = procedures.find(pending.back());
+		pending.pop_back();
+		if (it == procedures.end())
+		{
+			continue;
+		}
+		if (it->second.subroutines)
+		{
+			for (const auto& q : procedures)
+			{
+				result.insert(q.first);
+			}
+			return result;
+		}
+		for (const auto& q : it->second.calls)
+		{
+			if (result.insert(q).second)
+			{
+				pending.push_back(q);
+			}
+		}
+	}
+	return result;
+}
+
+// Local variables of PROCs which never call each other, directly or
+// not, are given the same storage. Byte variables only share with
+// byte variables, since those rely on the high byte staying zero.
+std::map<std::string, std::string> generator::get_shared_storage(const std::set<std::string>& byte_variables) const
+{
+	std::map<std::string, std::vector<std::string>> locals;
+	for (const auto& v : variable_scopes)
+	{
+		if (!v.second.local)
+		{
+			continue;
+		}
+		const auto& p = procedures.at(v.second.procedure);
+		const auto entered = std::any_of(p.lines.begin(), p.lines.end(), [this](int l) { return jump_targets.count(l) > 0; });
+		const auto open = (current_procedure() == v.second.procedure);
+		if (p.overlappable && !entered && !open)
+		{
+			locals[v.second.procedure].push_back(v.first);
+		}
+	}
+
+	std::map<std::string, std::set<std::string>> reachable;
+	for (const auto& l : locals)
+	{
+		reachable[l.first] = reachable_procedures(l.first);
+	}
+	const auto related = [&reachable](const std::string& a, const std::string& b) {
+		return (a == b) || (reachable.at(a).count(b) > 0) || (reachable.at(b).count(a) > 0);
+	};
+
+	struct slot
+	{
+		std::string representative;
+		bool byte;
+		std::set<std::string> procedures;
+	};
+	std::vector<slot> slots;
+	std::map<std::string, std::string> result;
+	for (const auto& l : locals)
+	{
+		for (const auto& v : l.second)
+		{
+			const auto byte = (byte_variables.count(v) > 0);
+			const auto it = std::find_if(slots.begin(), slots.end(), [&](const slot& s) {
+				return (s.byte == byte) && std::none_of(s.procedures.begin(), s.procedures.end(), [&](const std::string& p) { return related(p, l.first); });
+			});
+			if (it == slots.end())
+			{
+				slots.push_back({ v, byte, { l.first } });
+				continue;
+			}
+			it->procedures.insert(l.first);
+			result[v] = it->representative;
+		}
+	}
+	return result;
+}
+
+void generator::set_shared_storage(const std::map<std::string, std::string>& s)
+{
+	shared_storage = s;
+}
+
+std::string generator::storage_of(const std::string& label) const
+{
+	const auto it = shared_storage.find(label);
+	return (it == shared_storage.end()) ? label : it->second;
+}
+
+// Where each variable ends up and how much sharing storage saved
+void generator::write_memory_map(const std::map<std::string, int>& zero_page) const
+{
+	const auto size = cfg.get_number_interpretation()->get_size();
+	std::cout << std::endl << "*** MEMORY MAP ***" << std::endl;
+	for (const auto& v : variables)
+	{
+		const auto label = token(token_provider::TOKENS::VARIABLE) + v;
+		const auto storage = storage_of(label);
+		std::cout << label << " -> ";
+		if (storage != label)
+		{
+			std::cout << "shares " << storage;
+		}
+		else if (zero_page.count(label))
+		{
+			std::cout << "$" << std::hex << zero_page.at(label) << std::dec;
+		}
+		else
+		{
+			std::cout << "RAM";
+		}
+		std::cout << std::endl;
+	}
+	const auto all = variables.size() * size;
+	const auto shared = shared_storage.size() * size;
+	std::cout << "Variables take " << all - shared << " bytes instead of " << all << ", saved " << shared << " bytes" << std::endl;
+}
+
+void generator::new_line(const int& i)
 {
+	flush_operands();
+	new_statement();
+	current_line = i;
+	if (!stack_for.empty())
+	{
+		stack_for.top().scope.lines.insert(i);
+	}
+	if (!stack_procedure.empty())
+	{
+		procedures[stack_procedure.top()].lines.insert(i);
+	}
 	synth.synth(false) << token(token_provider::TOKENS::LINE_INDICATOR) << i << E_;
 }
 
+// Statements are counted in the body of the innermost loop
+void generator::new_statement()
+{
+	previous_statement_terminates = statement_terminates;
+	statement_terminates = false;
+	if (!stack_for.empty() && (stack_for.top().block.statements >= 0))
+	{
+		++stack_for.top().block.statements;
+	}
+}
+
 void generator::write_atari_registers() const
 {
 	synth.synth(false) << "; ATARI registers" << E_;
@@ -160,175 +676,1255 @@ void generator::write_atari_constants() const
 	}
 }
 
-void generator::put_integer_on_stack(const std::string& i) const {
+void generator::put_integer_on_stack(const std::string& i) {
 	synth.synth(false) << "; Put integer '" << i << "' on stack" << E_;
+	operands.emplace_back(operand::PLACE::IMMEDIATE, i);
+}
+
+void generator::pop_to(const std::string& target) {
+	synth.synth(false) << "; Pop from stack (" << expression_stack.get_name() << ") into '" << target << '\'' << E_;
 
-	synth.synth() << "mwa #" << i << " FR0" << E_;
-	push_from("FR0");
+	const auto o = take_operand();
+	if ("FR0" == target)
+	{
+		release_FR0();
+	}
+	load_operand(o, target);
 }
 
-void generator::pop_to(const std::string& target, const generator::STACK& stack) const {
-	synth.synth(false) << "; Pop from stack (" << stacks.at(stack).get_name() << ") into '" << target << '\'' << E_;
-	
-	// Do the pop
-	synth.synth() << "mwa #" << target << ' ' << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
-	synth.synth() << "mwa #" << stacks.at(stack).get_pointer() << ' ' << token(token_provider::TOKENS::PUSH_POP_PTR_TO_INC_DEC) << E_;
-	synth.synth() << "jsr POP_TO" << E_;
+void generator::pop_to_variable(const std::string& target) {
+	synth.synth(false) << "; Pop from stack into variable '" << target << '\'' << E_;
+	const auto label = token(token_provider::TOKENS::VARIABLE) + target;
+	note_use(label);
+	note_scope(label, true);
+	note_assignment(label, operands.empty() ? operand(operand::PLACE::STACK) : operands.back());
+	if (byte_variables.count(label))
+	{
+		// High byte of the variable stays zero
+		const auto o = take_operand();
+		if (o.is_on_stack())
+		{
+			synth.synth() << "dex" << E_;
+		}
+		synth.synth() << "lda " << get_operand_byte(o, 0, o.is_on_stack() ? 0 : -1) << E_;
+		synth.synth() << "sta " << label << E_;
+	}
+	else
+	{
+		pop_to(label);
+	}
+	if (!stack_for.empty())
+	{
+		stack_for.top().assigned.insert(token(token_provider::TOKENS::VARIABLE) + target);
+	}
 }
 
-void generator::peek_to(const std::string& target, const generator::STACK& stack) const {
-	synth.synth(false) << "; Peek from stack (" << stacks.at(stack).get_name() << ") into '" << target << '\'' << E_;
+void generator::push_from(const std::string& source) {
+	synth.synth(false) << "; Push from '" << source << "' to stack (" << expression_stack.get_name() << ')' << E_;
 
-	// Do the pop
-	synth.synth() << "mwa #" << target << ' ' << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
-	synth.synth() << "mwa #" << stacks.at(stack).get_pointer() << ' ' << token(token_provider::TOKENS::PUSH_POP_PTR_TO_INC_DEC) << E_;
-	synth.synth() << "jsr PEEK_TO" << E_;
+	// Result of the recent operation stays in FR0 until needed,
+	// anything else is copied since it may be overwritten soon
+	if ("FR0" == source)
+	{
+		operands.emplace_back(operand::PLACE::FR0);
+		return;
+	}
+	flush_operands();
+	push_bytes(source, source + "+1");
+	operands.emplace_back(operand::PLACE::STACK);
+	note_stack_depth();
 }
 
-void generator::pop_to_variable(const std::string& target) const {
-	synth.synth(false) << "; Pop from stack into variable '" << target << '\'' << E_;
-	pop_to(token(token_provider::TOKENS::VARIABLE) + target);
+void generator::push_from_variable(const std::string& source) {
+	synth.synth(false) << "; Push from variable '" << source << "\' into stack" << E_;
+	const auto label = token(token_provider::TOKENS::VARIABLE) + source;
+	note_use(label);
+	note_scope(label, false);
+	if (!stack_for.empty() && stack_for.top().inductive && (label == stack_for.top().counter))
+	{
+		push_induction({ label, 1, "", 0, "", 0 });
+		return;
+	}
+	operands.emplace_back(operand::PLACE::VARIABLE, label);
+}
+
+void generator::push_bytes(const std::string& low, const std::string& high) const {
+	const auto& s = expression_stack;
+	synth.synth() << "lda " << low << E_;
+	synth.synth() << "sta " << s.get_low_bytes() << ",x" << E_;
+	synth.synth() << "lda " << high << E_;
+	synth.synth() << "sta " << s.get_high_bytes() << ",x" << E_;
+	synth.synth() << "inx" << E_;
 }
 
-void generator::push_from(const std::string& source, const generator::STACK& stack) const {
-	synth.synth(false) << "; Push from '" << source << "' to stack (" << stacks.at(stack).get_name() << ')' << E_;
+// Popping more than was pushed reads whatever is
+// below on the runtime stack, as it always did
+operand generator::take_operand()
+{
+	if (operands.empty())
+	{
+		return operand(operand::PLACE::STACK);
+	}
+	const auto o = materialize(operands.back());
+	operands.pop_back();
+	return o;
+}
 
-	// Do the push
-	synth.synth() << "mwa #" << source << ' ' << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
-	synth.synth() << "mwa #" << stacks.at(stack).get_pointer() << ' ' << token(token_provider::TOKENS::PUSH_POP_PTR_TO_INC_DEC) << E_;
-	synth.synth() << "jsr PUSH_FROM" << E_;
+void generator::load_operand(const operand& o, const std::string& target) const {
+	if (o.is_on_stack())
+	{
+		const auto& s = expression_stack;
+		synth.synth() << "dex" << E_;
+		synth.synth() << "lda " << s.get_low_bytes() << ",x" << E_;
+		synth.synth() << "sta " << target << E_;
+		synth.synth() << "lda " << s.get_high_bytes() << ",x" << E_;
+		synth.synth() << "sta " << target << "+1" << E_;
+		return;
+	}
+	if (o.is_in_FR0() && "FR0" == target)
+	{
+		return;
+	}
+	synth.synth() << "mwa " << (operand::PLACE::IMMEDIATE == o.get_place() ? "#" : "") << (o.is_in_FR0() ? "FR0" : o.get_value()) << ' ' << target << E_;
 }
 
-void generator::push_from_variable(const std::string& source) const {
-	synth.synth(false) << "; Push from variable '" << source << "\' into stack" << E_;
-	push_from(token(token_provider::TOKENS::VARIABLE) + source);
+// Moves given number of bottom operands onto the runtime stack. Values already
+// there always form the bottom of the expression stack, so order is preserved.
+void generator::flush_operands(std::size_t count)
+{
+	for (std::size_t i = 0; i < count && i < operands.size(); ++i)
+	{
+		if (operands[i].is_on_stack())
+		{
+			continue;
+		}
+		operands[i] = materialize(operands[i]);
+		synth.synth(false) << "; Spill operand to stack" << E_;
+		push_bytes(operands[i].get_byte(0), operands[i].get_byte(1));
+		operands[i] = operand(operand::PLACE::STACK, "", fits_in_byte(operands[i]));
+	}
+	note_stack_depth();
+}
+
+// Only spilled operands take runtime stack entries
+void generator::note_stack_depth()
+{
+	const int depth = static_cast<int>(std::count_if(operands.begin(), operands.end(), [](const operand& o) { return o.is_on_stack(); }));
+	if (depth > EXPRESSION_STACK_CAPACITY)
+	{
+		throw std::runtime_error((boost::format("Expression too complex, it needs more than %1% stack entries") % EXPRESSION_STACK_CAPACITY).str());
+	}
+	expression_stack_depth = std::max(expression_stack_depth, depth);
+}
+
+int generator::get_expression_stack_depth() const
+{
+	return expression_stack_depth;
+}
+
+void generator::flush_operands()
+{
+	flush_operands(operands.size());
 }
 
-void generator::write_internal_variables() const {
-	spawn_compiler_variable(token(token_provider::TOKENS::PUSH_POP_TARGET_STACK_PTR), true);
-	spawn_compiler_variable(token(token_provider::TOKENS::PUSH_POP_PTR_TO_INC_DEC), true);
-	spawn_compiler_variable(token(token_provider::TOKENS::PUSH_POP_VALUE_PTR), true);
+// Saves the value cached in FR0 (if any) before FR0 gets overwritten
+void generator::release_FR0()
+{
+	for (std::size_t i = 0; i < operands.size(); ++i)
+	{
+		if (operands[i].is_in_FR0())
+		{
+			flush_operands(i + 1);
+			return;
+		}
+	}
+}
+
+void generator::drop_operands(int count)
+{
+	while (count--)
+	{
+		take_operand();
+	}
+}
+
+// Operands of an expression the parser gave up on. Code already emitted
+// for them stays, but the runtime stack gets the spilled entries back.
+void generator::discard_operands()
+{
+	for (const auto& o : operands)
+	{
+		if (o.is_on_stack())
+		{
+			synth.synth() << "dex" << E_;
+		}
+	}
+	operands.clear();
+}
+
+// Operands on the runtime stack are addressed relative to X,
+// slot -1 being the top of the stack
+std::string generator::get_operand_byte(const operand& o, int which, int slot) const
+{
+	if (o.is_on_stack())
+	{
+		const auto& s = expression_stack;
+		return (which ? s.get_high_bytes() : s.get_low_bytes()) + (slot ? (boost::format("%+d") % slot).str() : "") + ",x";
+	}
+	if (which && (operand::PLACE::VARIABLE == o.get_place()) && byte_variables.count(o.get_value()))
+	{
+		return "#0";
+	}
+	return o.get_byte(which);
+}
+
+// Combines two topmost operands byte-by-byte with the given instruction.
+// When both are already on the runtime stack the stack slots routine is
+// called, otherwise the operands are used in place and result lands in FR0.
+void generator::combine_operands(const std::string& routine, const std::string& prologue, const std::string& instruction, bool commutative)
+{
+	auto right = take_operand();
+	auto left = take_operand();
+	if (left.is_on_stack() && right.is_on_stack())
+	{
+		call_runtime(routine);
+		operands.emplace_back(operand::PLACE::STACK);
+		return;
+	}
+	if (commutative && right.is_in_FR0())
+	{
+		std::swap(left, right);
+	}
+	if (!left.is_in_FR0() && !right.is_in_FR0())
+	{
+		release_FR0();
+	}
+	if (!prologue.empty())
+	{
+		synth.synth() << prologue << E_;
+	}
+	for (int i = 0; i < 2; ++i)
+	{
+		synth.synth() << "lda " << get_operand_byte(left, i) << E_;
+		synth.synth() << instruction << ' ' << get_operand_byte(right, i) << E_;
+		synth.synth() << "sta FR0" << (i ? "+1" : "") << E_;
+	}
+	if (left.is_on_stack() || right.is_on_stack())
+	{
+		synth.synth() << "dex" << E_;
+	}
+	operands.emplace_back(operand::PLACE::FR0);
+}
+
+void generator::addition() {
+	synth.synth(false) << "; Execute addition of two topmost operands" << E_;
+	if (fold_inductions(1))
+	{
+		return;
+	}
+	combine_operands("BADD", "clc", "adc", true);
+}
+
+void generator::subtraction() {
+	synth.synth(false) << "; Execute subtraction of two topmost operands" << E_;
+	if (fold_inductions(-1))
+	{
+		return;
+	}
+	combine_operands("BSUB", "sec", "sbc", false);
+}
+
+void generator::multiplication() {
+	synth.synth(false) << "; Execute multiplication (FR0 * FR1). Result stored in FR0" << E_;
+
+	// Induction value times constant is still an induction value
+	int value;
+	if (operands.size() >= 2)
+	{
+		const auto& l = operands[operands.size() - 2];
+		const auto& r = operands.back();
+		induction d;
+		induction scaled;
+		if ((operand::PLACE::INDUCTION == l.get_place() && get_constant(r, value) && to_induction(l, d)) ||
+			(operand::PLACE::INDUCTION == r.get_place() && get_constant(l, value) && to_induction(r, d)))
+		{
+			if (combine_inductions({ "", 0, "", 0, "", 0 }, d, value, scaled))
+			{
+				operands.pop_back();
+				operands.pop_back();
+				push_induction(scaled);
+				return;
+			}
+		}
+	}
+
+	const auto right = take_operand();
+	const auto left = take_operand();
+
+	// Constant factor with only a few bits set is cheaper
+	// as a series of shifts and additions done in place
+	const bool constant_on_right = get_constant(right, value);
+	if (constant_on_right || get_constant(left, value))
+	{
+		const int negated = (-value) & 0xFFFF;
+		const auto bits = std::bitset<16>(value).count();
+		const auto negated_bits = std::bitset<16>(negated).count();
+		const bool negate = negated_bits < bits;
+		if ((negate ? negated_bits : bits) <= MAX_BITS_IN_INLINED_FACTOR)
+		{
+			release_FR0();
+			load_operand(constant_on_right ? left : right, "FR0");
+			multiply_FR0_by_constant(negate ? negated : value);
+			if (negate)
+			{
+				synth.synth() << "sec" << E_;
+				synth.synth() << "lda #0" << E_;
+				synth.synth() << "sbc FR0" << E_;
+				synth.synth() << "sta FR0" << E_;
+				synth.synth() << "lda #0" << E_;
+				synth.synth() << "sbc FR0+1" << E_;
+				synth.synth() << "sta FR0+1" << E_;
+			}
+			operands.emplace_back(operand::PLACE::FR0);
+			return;
+		}
+	}
+
+	load_operands_to_FR0_FR1(left, right);
+	call_runtime("BMUL");
+	operands.emplace_back(operand::PLACE::FR0);
+}
+
+void generator::division() {
+	synth.synth(false) << "; Execute division (FR0 / FR1). Result stored in FR0" << E_;
+	const auto right = take_operand();
+	const auto left = take_operand();
+
+	// Division by a power of two is just a shift
+	int value;
+	if (get_constant(right, value) && (1 == std::bitset<16>(value).count()))
+	{
+		int bits = 0;
+		while (value >>= 1)
+		{
+			++bits;
+		}
+		release_FR0();
+		load_operand(left, "FR0");
+		shift_FR0_right(bits);
+		operands.emplace_back(operand::PLACE::FR0);
+		return;
+	}
+
+	load_operands_to_FR0_FR1(left, right);
+	call_runtime("BDIV");
+	operands.emplace_back(operand::PLACE::FR0);
+}
+
+// Numbers are 16-bit unsigned at runtime
+bool generator::get_constant(const operand& o, int& value) const
+{
+	if (operand::PLACE::IMMEDIATE != o.get_place())
+	{
+		return false;
+	}
+	const auto& v = o.get_value();
+	if (v.empty() || (v.find_first_not_of("0123456789", '-' == v[0] ? 1 : 0) != std::string::npos))
+	{
+		return false;
+	}
+	value = std::stoi(v) & 0xFFFF;
+	return true;
+}
+
+// Constants, induction values and plain variables, which are loop
+// invariants unless assigned to in the body, are linear in the counter
+bool generator::to_induction(const operand& o, induction& d) const
+{
+	int value;
+	switch (o.get_place())
+	{
+	case operand::PLACE::IMMEDIATE:
+		if (!get_constant(o, value))
+		{
+			return false;
+		}
+		d = { "", 0, "", 0, "", value };
+		return true;
+	case operand::PLACE::INDUCTION:
+		d = inductions[std::stoi(o.get_value())];
+		return true;
+	case operand::PLACE::VARIABLE:
+		if ((0 != o.get_value().find(token(token_provider::TOKENS::VARIABLE))) ||
+			(std::string::npos != o.get_value().find('+')))
+		{
+			return false;
+		}
+		d = { "", 0, o.get_value(), 1, "", 0 };
+		return true;
+	default:
+		return false;
+	}
+}
+
+// result = a + factor * b, as long as it stays linear
+bool generator::combine_inductions(const induction& a, const induction& b, int factor, induction& result) const
+{
+	if ((!a.invariant.empty() && !b.invariant.empty() && (a.invariant != b.invariant)) ||
+		(!b.base.empty() && (!a.base.empty() || (1 != factor))))
+	{
+		return false;
+	}
+	induction r;
+	r.counter = a.counter.empty() ? b.counter : a.counter;
+	r.coefficient = (a.coefficient + factor * b.coefficient) & 0xFFFF;
+	r.invariant = a.invariant.empty() ? b.invariant : a.invariant;
+	r.invariant_coefficient = (a.invariant_coefficient + factor * b.invariant_coefficient) & 0xFFFF;
+	r.base = a.base.empty() ? b.base : a.base;
+	r.offset = (a.offset + factor * b.offset) & 0xFFFF;
+	if (0 == r.coefficient)
+	{
+		r.counter.clear();
+	}
+	if (0 == r.invariant_coefficient)
+	{
+		r.invariant.clear();
+	}
+	result = r;
+	return true;
+}
+
+// Adds (or subtracts) two topmost operands without emitting any code
+// when at least one of them is an induction value
+bool generator::fold_inductions(int sign)
+{
+	if (operands.size() < 2)
+	{
+		return false;
+	}
+	const auto& l = operands[operands.size() - 2];
+	const auto& r = operands.back();
+	induction a;
+	induction b;
+	induction result;
+	if (((operand::PLACE::INDUCTION != l.get_place()) && (operand::PLACE::INDUCTION != r.get_place())) ||
+		!to_induction(l, a) || !to_induction(r, b) || !combine_inductions(a, b, sign, result))
+	{
+		return false;
+	}
+	operands.pop_back();
+	operands.pop_back();
+	push_induction(result);
+	return true;
+}
+
+void generator::push_induction(const induction& d)
+{
+	if (d.counter.empty() && d.invariant.empty() && d.base.empty())
+	{
+		operands.emplace_back(operand::PLACE::IMMEDIATE, std::to_string(d.offset));
+		return;
+	}
+	operands.emplace_back(operand::PLACE::INDUCTION, std::to_string(inductions.size()));
+	inductions.push_back(d);
+}
+
+// Gives induction value a place. It is taken from the slot of the innermost
+// loop, which is recalculated in place when the loop has been found not to
+// keep it up to date. Only FR1 is used, so other operands remain intact.
+operand generator::materialize(const operand& o)
+{
+	if (operand::PLACE::INDUCTION != o.get_place())
+	{
+		return o;
+	}
+	const auto d = inductions[std::stoi(o.get_value())];
+	if ((1 == d.coefficient) && d.invariant.empty() && d.base.empty() && (0 == d.offset))
+	{
+		return operand(operand::PLACE::VARIABLE, d.counter);
+	}
+
+	auto& loop = stack_for.top();
+	std::string slot;
+	for (const auto& s : loop.induction_slots)
+	{
+		const auto& e = s.second;
+		if ((e.coefficient == d.coefficient) && (e.invariant == d.invariant) && (e.invariant_coefficient == d.invariant_coefficient) &&
+			(e.base == d.base) && (e.offset == d.offset))
+		{
+			slot = s.first;
+			break;
+		}
+	}
+	if (slot.empty())
+	{
+		slot = token(token_provider::TOKENS::FOR_INDUCTION) + std::to_string(loop.id) + '_' + std::to_string(loop.induction_slots.size());
+		loop.induction_slots.emplace_back(slot, d);
+		for_loop_slots.push_back(slot);
+	}
+	note_use(slot);
+
+	synth.synth(false) << ".if " << token(token_provider::TOKENS::FOR_INDUCTION_VALID) << loop.id << " = 0" << E_;
+	compute_induction(d, slot);
+	synth.synth(false) << ".endif" << E_;
+	return operand(operand::PLACE::VARIABLE, slot);
+}
+
+void generator::compute_induction(const induction& d, const std::string& target) const
+{
+	const auto constant = (d.base.empty() ? "" : d.base + '+') + std::to_string(d.offset);
+	synth.synth() << "lda #<(" << constant << ')' << E_;
+	synth.synth() << "sta " << target << E_;
+	synth.synth() << "lda #>(" << constant << ')' << E_;
+	synth.synth() << "sta " << target << "+1" << E_;
+	if (!d.counter.empty())
+	{
+		synth.synth() << "mwa " << d.counter << " FR1" << E_;
+		add_multiple_of_FR1(target, d.coefficient);
+	}
+	if (!d.invariant.empty())
+	{
+		synth.synth() << "mwa " << d.invariant << " FR1" << E_;
+		add_multiple_of_FR1(target, d.invariant_coefficient);
+	}
+}
+
+// Adds FR1 shifted by each set bit of the factor. FR1 is destroyed.
+void generator::add_multiple_of_FR1(const std::string& target, int factor) const
+{
+	for (; factor; factor >>= 1)
+	{
+		if (factor & 1)
+		{
+			synth.synth() << "adw " << target << " FR1" << E_;
+		}
+		if (factor > 1)
+		{
+			synth.synth() << "asl FR1" << E_;
+			synth.synth() << "rol FR1+1" << E_;
+		}
+	}
+}
+
+// Slots, if any, are kept up to date only if the body neither
+// changes what they depend on nor calls anything that could
+bool generator::inductions_valid(const for_loop& loop) const
+{
+	if (!loop.inductive || loop.calls || loop.induction_slots.empty())
+	{
+		return false;
+	}
+	if (loop.assigned.count(loop.counter))
+	{
+		return false;
+	}
+	for (const auto& slot : loop.induction_slots)
+	{
+		if (!slot.second.invariant.empty() && loop.assigned.count(slot.second.invariant))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Remembers the store made by the first statement in the body of the innermost loop
+void generator::note_block_store(const std::string& destination, const operand& value, int size)
+{
+	if (stack_for.empty())
+	{
+		return;
+	}
+	auto& block = stack_for.top().block;
+	if (1 == block.statements && 0 == block.stores)
+	{
+		block.destination = destination;
+		block.source = value.is_in_FR0() ? value.get_value() : "";
+		block.value = value;
+		block.size = size;
+	}
+	++block.stores;
+}
+
+const generator::induction* generator::find_induction_slot(const for_loop& loop, const std::string& slot) const
+{
+	for (const auto& s : loop.induction_slots)
+	{
+		if (s.first == slot)
+		{
+			return &s.second;
+		}
+	}
+	return nullptr;
+}
+
+bool generator::is_block_operation(const for_loop& loop) const
+{
+	const auto& block = loop.block;
+	if (2 != block.statements || 1 != block.stores || block.branches || loop.assigned.count(loop.counter))
+	{
+		return false;
+	}
+	const auto destination = find_induction_slot(loop, block.destination);
+	if (!destination || (block.size != destination->coefficient) ||
+		(!destination->invariant.empty() && loop.assigned.count(destination->invariant)))
+	{
+		return false;
+	}
+	const auto& value = block.value;
+	switch (value.get_place())
+	{
+	case operand::PLACE::IMMEDIATE:
+		return true;
+	case operand::PLACE::VARIABLE:
+		return (value.get_value() != loop.counter) &&
+			((0 == value.get_value().find(token(token_provider::TOKENS::VARIABLE))) ||
+			(0 == value.get_value().find(token(token_provider::TOKENS::INTEGER_ARRAY))));
+	case operand::PLACE::FR0:
+	{
+		const auto source = find_induction_slot(loop, block.source);
+		return source && (2 == block.size) && (2 == source->coefficient) &&
+			(source->invariant.empty() || !loop.assigned.count(source->invariant));
+	}
+	default:
+		return false;
+	}
+}
+
+// Does the work of the whole loop at once. Loop runs at least once,
+// so the number of elements is the distance to the limit plus one,
+// or just one when the counter starts past the limit.
+void generator::write_block_operation(const for_loop& loop)
+{
+	const auto& block = loop.block;
+	synth.synth(false) << token(token_provider::TOKENS::FOR_BLOCK_OPERATION) << loop.id << E_;
+	compute_induction(*find_induction_slot(loop, block.destination), "BLOCK_DESTINATION");
+	if (!block.source.empty())
+	{
+		compute_induction(*find_induction_slot(loop, block.source), "BLOCK_SOURCE");
+	}
+	else
+	{
+		synth.synth() << "lda " << block.value.get_byte(0) << E_;
+		synth.synth() << "sta BLOCK_VALUE" << E_;
+		synth.synth() << "lda " << block.value.get_byte(1 == block.size ? 0 : 1) << E_;
+		synth.synth() << "sta BLOCK_VALUE+1" << E_;
+	}
+
+	const auto label = get_next_generic_label();
+	synth.synth() << "sec" << E_;
+	synth.synth() << "lda " << loop.limit.get_byte(0) << E_;
+	synth.synth() << "sbc " << loop.counter << E_;
+	synth.synth() << "sta BLOCK_LENGTH" << E_;
+	synth.synth() << "lda " << loop.limit.get_byte(1) << E_;
+	synth.synth() << "sbc " << loop.counter << "+1" << E_;
+	synth.synth() << "sta BLOCK_LENGTH+1" << E_;
+	synth.synth() << "bcs " << label << E_;
+	synth.synth() << "mwa #0 BLOCK_LENGTH" << E_;
+	synth.synth(false) << label << E_;
+	synth.synth() << "inw BLOCK_LENGTH" << E_;
+	synth.synth() << "adw " << loop.counter << " BLOCK_LENGTH" << E_;
+	if (2 == block.size)
+	{
+		synth.synth() << "asl BLOCK_LENGTH" << E_;
+		synth.synth() << "rol BLOCK_LENGTH+1" << E_;
+	}
+	call_runtime(block.source.empty() ? "BLOCK_FILL" : "BLOCK_COPY");
+}
+
+void generator::load_operands_to_FR0_FR1(const operand& left, const operand& right)
+{
+	load_operand(right, "FR1");
+	release_FR0();
+	load_operand(left, "FR0");
+}
+
+void generator::shift_FR0_left(int bits) const {
+	if (bits >= 8)
+	{
+		synth.synth() << "mva FR0 FR0+1" << E_;
+		synth.synth() << "mva #0 FR0" << E_;
+		for (bits -= 8; bits > 0; --bits)
+		{
+			synth.synth() << "asl FR0+1" << E_;
+		}
+		return;
+	}
+	for (; bits > 0; --bits)
+	{
+		synth.synth() << "asl FR0" << E_;
+		synth.synth() << "rol FR0+1" << E_;
+	}
+}
+
+void generator::shift_FR0_right(int bits) const {
+	if (bits >= 8)
+	{
+		synth.synth() << "mva FR0+1 FR0" << E_;
+		synth.synth() << "mva #0 FR0+1" << E_;
+		for (bits -= 8; bits > 0; --bits)
+		{
+			synth.synth() << "lsr FR0" << E_;
+		}
+		return;
+	}
+	for (; bits > 0; --bits)
+	{
+		synth.synth() << "lsr FR0+1" << E_;
+		synth.synth() << "ror FR0" << E_;
+	}
+}
+
+// Horner's scheme over the bits of the factor: shift the partial
+// product left and add the multiplicand (kept in FR1) for each set bit
+void generator::multiply_FR0_by_constant(int value) const {
+	if (0 == value)
+	{
+		synth.synth() << "mwa #0 FR0" << E_;
+		return;
+	}
+	int bit = 15;
+	while (!(value & (1 << bit)))
+	{
+		--bit;
+	}
+	if (value & ((1 << bit) - 1))
+	{
+		synth.synth() << "mwa FR0 FR1" << E_;
+	}
+	int pending_shift = 0;
+	while (bit--)
+	{
+		++pending_shift;
+		if (value & (1 << bit))
+		{
+			shift_FR0_left(pending_shift);
+			pending_shift = 0;
+			synth.synth() << "adw FR0 FR1" << E_;
+		}
+	}
+	shift_FR0_left(pending_shift);
+}
+
+void generator::logical_and() const {
+	synth.synth(false) << "; Execute logical and (FR0 AND FR1). Result stored in FR0" << E_;
+	call_runtime("LOGICAL_AND");
+}
+
+void generator::logical_or() const {
+	synth.synth(false) << "; Execute logical or (FR0 OR FR1). Result stored in FR0" << E_;
+	call_runtime("LOGICAL_OR");
+}
+
+void generator::binary_xor() {
+	synth.synth(false) << "; Execute binary exclusive or of two topmost operands" << E_;
+	combine_operands("BINARY_XOR", "", "eor", true);
+}
+
+void generator::binary_and() {
+	synth.synth(false) << "; Execute binary and of two topmost operands" << E_;
+	combine_operands("BINARY_AND", "", "and", true);
+}
+
+void generator::binary_or() {
+	synth.synth(false) << "; Execute binary or of two topmost operands" << E_;
+	combine_operands("BINARY_OR", "", "ora", true);
+}
+
+void generator::compare(const COMPARISON& c) {
+	const auto right = take_operand();
+	const auto left = take_operand();
+	load_operands_to_FR0_FR1(left, right);
+	switch (c)
+	{
+	case COMPARISON::EQUAL:
+	case COMPARISON::NOT_EQUAL:
+		compare_equal();
+		break;
+	case COMPARISON::LESS:
+	case COMPARISON::GREATER_EQUAL:
+		compare_less();
+		break;
+	case COMPARISON::GREATER:
+	case COMPARISON::LESS_EQUAL:
+		compare_greater();
+		break;
+	}
+	if (COMPARISON::NOT_EQUAL == c || COMPARISON::GREATER_EQUAL == c || COMPARISON::LESS_EQUAL == c)
+	{
+		FR0_boolean_invert();
+	}
+	operands.emplace_back(operand::PLACE::FR0);
+}
+
+generator::COMPARISON generator::negate(const COMPARISON& c)
+{
+	switch (c)
+	{
+	case COMPARISON::EQUAL:
+		return COMPARISON::NOT_EQUAL;
+	case COMPARISON::NOT_EQUAL:
+		return COMPARISON::EQUAL;
+	case COMPARISON::LESS:
+		return COMPARISON::GREATER_EQUAL;
+	case COMPARISON::GREATER_EQUAL:
+		return COMPARISON::LESS;
+	case COMPARISON::GREATER:
+		return COMPARISON::LESS_EQUAL;
+	case COMPARISON::LESS_EQUAL:
+		return COMPARISON::GREATER;
+	}
+	throw std::logic_error("unknown comparison");
+}
+
+// Unsigned 16-bit comparison. Leaves C set when left >= right
+// and Z set when they are equal.
+void generator::compare_words(const std::string& left_low, const std::string& left_high, const std::string& right_low, const std::string& right_high) {
+	const auto label = get_next_generic_label();
+	synth.synth() << "lda " << left_high << E_;
+	synth.synth() << "cmp " << right_high << E_;
+	synth.synth() << "bne " << label << E_;
+	synth.synth() << "lda " << left_low << E_;
+	synth.synth() << "cmp " << right_low << E_;
+	synth.synth(false) << label << E_;
+}
+
+// Comparison of two constants, decided at compile time
+bool generator::holds(const COMPARISON& c, int left, int right)
+{
+	switch (c)
+	{
+	case COMPARISON::EQUAL:
+		return left == right;
+	case COMPARISON::NOT_EQUAL:
+		return left != right;
+	case COMPARISON::LESS:
+		return left < right;
+	case COMPARISON::LESS_EQUAL:
+		return left <= right;
+	case COMPARISON::GREATER:
+		return left > right;
+	case COMPARISON::GREATER_EQUAL:
+		return left >= right;
+	default:
+		throw std::logic_error("unknown comparison");
+	}
+}
+
+// Branch with the outcome known at compile time is either
+// a plain jump or no code at all
+void generator::branch_always(bool taken, const std::string& target)
+{
+	if (taken)
+	{
+		synth.synth() << "jmp " << target << E_;
+	}
+}
+
+// Compares two topmost operands and jumps to the target when the comparison
+// has the given outcome. Greater and less-or-equal are done with swapped
+// operands, so that a single flag decides in each case. Comparison of
+// constants is decided at compile time.
+void generator::branch_on(const COMPARISON& c, bool outcome, const std::string& target) {
+	synth.synth(false) << "; Compare two topmost operands and branch" << E_;
+	int left_value;
+	int right_value;
+	if ((operands.size() >= 2) && get_constant(operands[operands.size() - 2], left_value) && get_constant(operands.back(), right_value))
+	{
+		operands.pop_back();
+		operands.pop_back();
+		branch_always(holds(c, left_value, right_value) == outcome, target);
+		resolve_short_circuit(outcome, target);
+		return;
+	}
+	auto right = take_operand();
+	auto left = take_operand();
+	auto relation = outcome ? negate(c) : c;
+	const bool swapped = (COMPARISON::GREATER == relation || COMPARISON::LESS_EQUAL == relation);
+	if (swapped)
+	{
+		std::swap(left, right);
+		relation = (COMPARISON::GREATER == relation) ? COMPARISON::LESS : COMPARISON::GREATER_EQUAL;
+	}
+
+	// Drop the operands from the runtime stack up front, since "dex" affects the flags
+	int left_slot = 0;
+	int right_slot = 0;
+	if (left.is_on_stack() && right.is_on_stack())
+	{
+		synth.synth() << "dex" << E_;
+		synth.synth() << "dex" << E_;
+		(swapped ? left_slot : right_slot) = 1;
+	}
+	else if (left.is_on_stack() || right.is_on_stack())
+	{
+		synth.synth() << "dex" << E_;
+	}
+	if (fits_in_byte(left) && fits_in_byte(right))
+	{
+		synth.synth() << "lda " << get_operand_byte(left, 0, left_slot) << E_;
+		synth.synth() << "cmp " << get_operand_byte(right, 0, right_slot) << E_;
+	}
+	else
+	{
+		compare_words(get_operand_byte(left, 0, left_slot), get_operand_byte(left, 1, left_slot), get_operand_byte(right, 0, right_slot), get_operand_byte(right, 1, right_slot));
+	}
+
+	switch (relation)
+	{
+	case COMPARISON::EQUAL:
+		synth.synth() << "jne " << target << E_;
+		break;
+	case COMPARISON::NOT_EQUAL:
+		synth.synth() << "jeq " << target << E_;
+		break;
+	case COMPARISON::LESS:
+		synth.synth() << "jcs " << target << E_;
+		break;
+	case COMPARISON::GREATER_EQUAL:
+		synth.synth() << "jcc " << target << E_;
+		break;
+	default:
+		throw std::logic_error("comparison not normalized");
+	}
+	resolve_short_circuit(outcome, target);
 }
 
-void generator::spawn_compiler_variable(const std::string& name, bool zero_page) const {
-	synth.synth(false) << "; Creating compiler variable '" << name << '\'';
-	if (zero_page)
+// Jumps to the target when the topmost operand has the given logical value
+void generator::branch_on(bool outcome, const std::string& target) {
+	int value;
+	if (!operands.empty() && get_constant(operands.back(), value))
 	{
-		synth.synth(false) << " on ZP";
+		operands.pop_back();
+		branch_always((0 != value) == outcome, target);
+		resolve_short_circuit(outcome, target);
+		return;
 	}
-	synth.synth(false) << E_;
-
-	synth.synth(false) << "." <<
-		(zero_page ? "zp" : "")
-		<< "var " << name << " .word" << E_;
-}
-
-void generator::init_pointer(const std::string& name, const std::string& source) const {
-	synth.synth(false) << "; Init pointer '" << name << "' with address of '" << source << '\'' << E_;
-	synth.synth() << "lda <" << source << E_;
-	synth.synth() << "sta " << name << E_;
-	synth.synth() << "lda >" << source << E_;
-	synth.synth() << "sta " << name << "+1" << E_;
-}
-
-void generator::addition() const {
-	synth.synth(false) << "; Execute addition (FR0 + FR1). Result stored in FR0" << E_;
-	synth.synth() << "jsr BADD" << E_;
-}
-
-void generator::subtraction() const {
-	synth.synth(false) << "; Execute subtraction (FR0 - FR1). Result stored in FR0" << E_;
-	synth.synth() << "jsr BSUB" << E_;
+	const auto o = take_operand();
+	int slot = -1;
+	if (o.is_on_stack())
+	{
+		synth.synth() << "dex" << E_;
+		slot = 0;
+	}
+	synth.synth() << "lda " << get_operand_byte(o, 0, slot) << E_;
+	if (!fits_in_byte(o))
+	{
+		synth.synth() << "ora " << get_operand_byte(o, 1, slot) << E_;
+	}
+	synth.synth() << (outcome ? "jne " : "jeq ") << target << E_;
+	resolve_short_circuit(outcome, target);
 }
 
-void generator::multiplication() const {
-	synth.synth(false) << "; Execute multiplication (FR0 * FR1). Result stored in FR0" << E_;
-	synth.synth() << "jsr BMUL" << E_;
+// Left operand of AND (OR) decides alone when it is false (true),
+// so the branch skips evaluation of the right operand. Where the
+// skipping branch lands is known once the whole operation has been
+// consumed, either by another branch or as a value.
+void generator::short_circuit(bool is_and)
+{
+	flush_operands(operands.size() - 1);
+	stack_short_circuit.push({ get_next_generic_label(), is_and });
+	branch_on(!is_and, stack_short_circuit.top().label);
 }
 
-void generator::division() const {
-	synth.synth(false) << "; Execute division (FR0 / FR1). Result stored in FR0" << E_;
-	synth.synth() << "jsr BDIV" << E_;
+void generator::short_circuit(bool is_and, const COMPARISON& c)
+{
+	flush_operands(operands.size() - 2);
+	stack_short_circuit.push({ get_next_generic_label(), is_and });
+	branch_on(c, !is_and, stack_short_circuit.top().label);
 }
 
-void generator::logical_and() const {
-	synth.synth(false) << "; Execute logical and (FR0 AND FR1). Result stored in FR0" << E_;
-	synth.synth() << "jsr LOGICAL_AND" << E_;
+void generator::close_short_circuit()
+{
+	pending_short_circuits.push_back(stack_short_circuit.top());
+	stack_short_circuit.pop();
 }
 
-void generator::logical_or() const {
-	synth.synth(false) << "; Execute logical or (FR0 OR FR1). Result stored in FR0" << E_;
-	synth.synth() << "jsr LOGICAL_OR" << E_;
+// Right operand of the pending operations has just been branched on. Each
+// skipping branch shares the target when both branches mean the same,
+// otherwise it continues right here.
+void generator::resolve_short_circuit(bool outcome, const std::string& target)
+{
+	for (const auto& s : pending_short_circuits)
+	{
+		if (s.is_and != outcome)
+		{
+			synth.synth(false) << s.label << " equ " << target << E_;
+		}
+		else
+		{
+			synth.synth(false) << s.label << E_;
+		}
+	}
+	pending_short_circuits.clear();
 }
 
-void generator::binary_xor() const {
-	synth.synth(false) << "; Execute binary exclusive or (FR0 EXOR FR1). Result stored in FR0" << E_;
-	synth.synth() << "jsr BINARY_XOR" << E_;
+void generator::short_circuit_value()
+{
+	const auto label = get_next_generic_label();
+	branch_on(false, label);
+	write_short_circuit_value(label);
 }
 
-void generator::binary_and() const {
-	synth.synth(false) << "; Execute binary and (FR0 & FR1). Result stored in FR0" << E_;
-	synth.synth() << "jsr BINARY_AND" << E_;
+void generator::short_circuit_value(const COMPARISON& c)
+{
+	const auto label = get_next_generic_label();
+	branch_on(c, false, label);
+	write_short_circuit_value(label);
 }
 
-void generator::binary_or() const {
-	synth.synth(false) << "; Execute binary or (FR0 ! FR1). Result stored in FR0" << E_;
-	synth.synth() << "jsr BINARY_OR" << E_;
+void generator::write_short_circuit_value(const std::string& on_false)
+{
+	const auto done = get_next_generic_label();
+	synth.synth() << "mwa #1 FR0" << E_;
+	synth.synth() << "jmp " << done << E_;
+	synth.synth(false) << on_false << E_;
+	synth.synth() << "mwa #0 FR0" << E_;
+	synth.synth(false) << done << E_;
+	operands.emplace_back(operand::PLACE::FR0);
 }
 
 void generator::compare_equal() const {
 	synth.synth(false) << "; Comparing FR0 and FR1 for equality" << E_;
 	synth.synth() << "lda #0" << E_;
 	synth.synth() << "sta INTEGER_COMPARE_TMP" << E_;
-	synth.synth() << "jsr COMPARE_FR0_FR1" << E_;
+	call_runtime("COMPARE_FR0_FR1");
 }
 
 void generator::compare_less() const {
 	synth.synth(false) << "; Comparing FR0 and FR1 for less" << E_;
 	synth.synth() << "lda #1" << E_;
 	synth.synth() << "sta INTEGER_COMPARE_TMP" << E_;
-	synth.synth() << "jsr COMPARE_FR0_FR1" << E_;
+	call_runtime("COMPARE_FR0_FR1");
 }
 
 void generator::compare_greater() const {
 	synth.synth(false) << "; Comparing FR0 and FR1 for greater" << E_;
 	synth.synth() << "lda #-1" << E_;
 	synth.synth() << "sta INTEGER_COMPARE_TMP" << E_;
-	synth.synth() << "jsr COMPARE_FR0_FR1" << E_;
+	call_runtime("COMPARE_FR0_FR1");
 }
 
-void generator::assign_to_array(const std::string& a) const {
-	synth.synth() << "mwa #" << token(token_provider::TOKENS::INTEGER_ARRAY) << a << "+4 ARRAY_ASSIGNMENT_TMP_ADDRESS" << E_;
-	synth.synth() << "mwa " << token(token_provider::TOKENS::INTEGER_ARRAY) << a << " ARRAY_ASSIGNMENT_TMP_SIZE" << E_;
-	synth.synth() << "jsr INIT_ARRAY_OFFSET" << E_;
-	synth.synth() << "ldy #" << cfg.get_number_interpretation()->get_size()-1 << E_;
-	synth.synth(false) << "@" << E_;
-	synth.synth() << "lda ARRAY_ASSIGNMENT_TMP_VALUE,y" << E_;
+void generator::assign_to_array(const basic_array& a) {
+	// Element at constant indices is addressed directly
+	std::string element;
+	if (get_constant_element(a, 1, element))
+	{
+		const auto value = take_operand();
+		drop_operands(a.is_two_dimensional() ? 2 : 1);
+		load_operand(value, element);
+		return;
+	}
+
+	auto value = take_operand();
+	const auto stored = value;
+	if (value.is_on_stack() || value.is_in_FR0())
+	{
+		load_operand(value, "ARRAY_ASSIGNMENT_TMP_VALUE");
+		value = operand(operand::PLACE::VARIABLE, "ARRAY_ASSIGNMENT_TMP_VALUE");
+	}
+	note_block_store(point_to_element(a), stored, cfg.get_number_interpretation()->get_size());
+	synth.synth() << "ldy #0" << E_;
+	synth.synth() << "lda " << value.get_byte(0) << E_;
+	synth.synth() << "sta (ARRAY_ASSIGNMENT_TMP_ADDRESS),y" << E_;
+	synth.synth() << "iny" << E_;
+	synth.synth() << "lda " << value.get_byte(1) << E_;
 	synth.synth() << "sta (ARRAY_ASSIGNMENT_TMP_ADDRESS),y" << E_;
-	synth.synth() << "dey" << E_;
-	synth.synth() << "cpy #-1" << E_;
-	synth.synth() << "bne @-" << E_;
 }
 
-void generator::retrieve_from_array(const std::string& a) const {
-	synth.synth() << "mwa #" << token(token_provider::TOKENS::INTEGER_ARRAY) << a << "+4 ARRAY_ASSIGNMENT_TMP_ADDRESS" << E_;
-	synth.synth() << "mwa " << token(token_provider::TOKENS::INTEGER_ARRAY) << a << " ARRAY_ASSIGNMENT_TMP_SIZE" << E_;
-	synth.synth() << "jsr INIT_ARRAY_OFFSET" << E_;
-	synth.synth() << "ldy #" << cfg.get_number_interpretation()->get_size()-1 << E_;
-	synth.synth(false) << "@" << E_;
+void generator::retrieve_from_array(const basic_array& a) {
+	std::string element;
+	if (get_constant_element(a, 0, element))
+	{
+		drop_operands(a.is_two_dimensional() ? 2 : 1);
+		operands.emplace_back(operand::PLACE::VARIABLE, element);
+		return;
+	}
+
+	// Element read through an induction slot remembers the slot,
+	// so that storing it right away can be recognized as a copy
+	const auto slot = point_to_element(a);
+	release_FR0();
+	synth.synth() << "ldy #0" << E_;
 	synth.synth() << "lda (ARRAY_ASSIGNMENT_TMP_ADDRESS),y" << E_;
-	synth.synth() << "sta FR0,y" << E_;
-	synth.synth() << "dey" << E_;
-	synth.synth() << "cpy #-1" << E_;
-	synth.synth() << "bne @-" << E_;
+	synth.synth() << "sta FR0" << E_;
+	synth.synth() << "iny" << E_;
+	synth.synth() << "lda (ARRAY_ASSIGNMENT_TMP_ADDRESS),y" << E_;
+	synth.synth() << "sta FR0+1" << E_;
+	operands.emplace_back(operand::PLACE::FR0, slot);
+}
+
+// Takes the index operands and points ARRAY_ASSIGNMENT_TMP_ADDRESS at the
+// element. The column offset is a shift, the row offset comes from the
+// row table, a shift or inlined multiplication by the known row size.
+// Arrays not declared yet have their row size read from the header.
+std::string generator::point_to_element(const basic_array& a) {
+	const auto declared = arrays.find(a.get_name());
+	const bool known = declared != arrays.end();
+	const auto array = get_array_token(a.get_name());
+	const int stride = known ? get_row_stride(declared->second) : 0;
+
+	bool has_row = a.is_two_dimensional();
+
+	// Index linear in the counter of the enclosing loop makes
+	// the element address an induction value as well
+	const std::size_t count = has_row ? 2 : 1;
+	if ((operands.size() >= count) && (!has_row || known))
+	{
+		bool inductive = false;
+		induction address{ "", 0, "", 0, get_elements_token(a.get_name()), 0 };
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			const auto& o = operands[operands.size() - count + i];
+			induction d;
+			inductive = inductive || (operand::PLACE::INDUCTION == o.get_place());
+			if (!to_induction(o, d) || !combine_inductions(address, d, i ? stride : cfg.get_number_interpretation()->get_size(), address))
+			{
+				inductive = false;
+				break;
+			}
+		}
+		if (inductive)
+		{
+			operands.erase(operands.end() - count, operands.end());
+			push_induction(address);
+			const auto slot = take_operand();
+			load_operand(slot, "ARRAY_ASSIGNMENT_TMP_ADDRESS");
+			return slot.get_value();
+		}
+	}
+
+	const auto row = has_row ? take_operand() : operand(operand::PLACE::IMMEDIATE, "0");
+	const auto column = take_operand();
+	const int row_slot = -1;
+	const int column_slot = row.is_on_stack() ? -2 : -1;
+
+	// Constant row within bounds only moves the base
+	int base = 0;
+	int row_index;
+	if (has_row && known && get_constant(row, row_index) && (static_cast<std::size_t>(row_index) <= declared->second.get_size(1)))
+	{
+		base += row_index * stride;
+		has_row = false;
+	}
+	const bool use_row_table = known && has_row_table(declared->second);
+
+	release_FR0();
+	synth.synth() << "lda " << get_operand_byte(column, 0, column_slot) << E_;
+	synth.synth() << "asl" << E_;
+	synth.synth() << "sta ARRAY_ASSIGNMENT_TMP_ADDRESS" << E_;
+	synth.synth() << "lda " << get_operand_byte(column, 1, column_slot) << E_;
+	synth.synth() << "rol" << E_;
+	synth.synth() << "sta ARRAY_ASSIGNMENT_TMP_ADDRESS+1" << E_;
+	if (has_row)
+	{
+		if (use_row_table)
+		{
+			synth.synth() << "ldy " << get_operand_byte(row, 0, row_slot) << E_;
+		}
+		else if (!row.is_in_FR0())
+		{
+			synth.synth() << "lda " << get_operand_byte(row, 0, row_slot) << E_;
+			synth.synth() << "sta FR0" << E_;
+			synth.synth() << "lda " << get_operand_byte(row, 1, row_slot) << E_;
+			synth.synth() << "sta FR0+1" << E_;
+		}
+	}
+	if (column.is_on_stack() || row.is_on_stack())
+	{
+		synth.synth() << "dex" << E_;
+	}
+	if (column.is_on_stack() && row.is_on_stack())
+	{
+		synth.synth() << "dex" << E_;
+	}
+	synth.synth() << "adw ARRAY_ASSIGNMENT_TMP_ADDRESS #" << get_elements_token(a.get_name()) << '+' << base << E_;
+	if (!has_row)
+	{
+		return "";
+	}
+
+	if (use_row_table)
+	{
+		synth.synth() << "clc" << E_;
+		synth.synth() << "lda ARRAY_ASSIGNMENT_TMP_ADDRESS" << E_;
+		synth.synth() << "adc " << array << "_ROWS_LO,y" << E_;
+		synth.synth() << "sta ARRAY_ASSIGNMENT_TMP_ADDRESS" << E_;
+		synth.synth() << "lda ARRAY_ASSIGNMENT_TMP_ADDRESS+1" << E_;
+		synth.synth() << "adc " << array << "_ROWS_HI,y" << E_;
+		synth.synth() << "sta ARRAY_ASSIGNMENT_TMP_ADDRESS+1" << E_;
+		return "";
+	}
+	if (!known)
+	{
+		synth.synth() << "mwa " << array << " FR1" << E_;
+		call_runtime("BMUL");
+		shift_FR0_left(1);
+	}
+	else if (1 == std::bitset<16>(stride).count())
+	{
+		int bits = 0;
+		for (int value = stride; value >>= 1;)
+		{
+			++bits;
+		}
+		shift_FR0_left(bits);
+	}
+	else
+	{
+		multiply_FR0_by_constant(stride);
+	}
+	synth.synth() << "adw ARRAY_ASSIGNMENT_TMP_ADDRESS FR0" << E_;
+	return "";
+}
+
+// Size of the array row in bytes
+int generator::get_row_stride(const basic_array& a) const
+{
+	return static_cast<int>(a.get_size(0) + 1) * cfg.get_number_interpretation()->get_size();
+}
+
+// Row offsets of two dimensional arrays are looked up in a table, unless
+// the row size is a power of two or there are too many rows to index by Y
+bool generator::has_row_table(const basic_array& a) const
+{
+	return (a.get_size(1) > 0) &&
+		(1 != std::bitset<16>(get_row_stride(a)).count()) &&
+		(a.get_size(1) < MAX_ROW_TABLE_SIZE);
+}
+
+// Resolves the element address at compile time when the array is declared
+// and its indices, located below given number of operands, are constant
+// and within bounds
+bool generator::get_constant_element(const basic_array& a, std::size_t depth, std::string& element) const
+{
+	const auto declared = arrays.find(a.get_name());
+	const std::size_t count = a.is_two_dimensional() ? 2 : 1;
+	if (declared == arrays.end() || operands.size() < depth + count)
+	{
+		return false;
+	}
+	int index[2] = { 0, 0 };
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		if (!get_constant(operands[operands.size() - depth - count + i], index[i]) ||
+			static_cast<std::size_t>(index[i]) > declared->second.get_size(i))
+		{
+			return false;
+		}
+	}
+	const auto offset = index[0] * cfg.get_number_interpretation()->get_size() + index[1] * get_row_stride(declared->second);
+	element = get_elements_token(a.get_name()) + '+' + std::to_string(offset);
+	return true;
 }
 
-void generator::random() const {
-	synth.synth() << "jsr PUT_RANDOM_IN_FR0" << E_;
+void generator::random() {
+	release_FR0();
+	call_runtime("PUT_RANDOM_IN_FR0");
 }
 
 void generator::FP_to_ASCII() const {
-	synth.synth() << "jsr FASC" << E_;
+	call_runtime("FASC");
 }
 
 void generator::init_print() const {
@@ -342,25 +1938,44 @@ void generator::init_print() const {
 
 void generator::print_LBUFF() const {
 	synth.synth(false) << "; Printing string located at LBUFF" << E_;
-	synth.synth() << "jsr PUTSTRING" << E_;
+	call_runtime("PUTSTRING");
 }
 
 void generator::FR0_boolean_invert() const {
 	synth.synth(false) << "; Inverting logical (boolean) value stored in FR0" << E_;
-	synth.synth() << "jsr FR0_boolean_invert" << E_;
+	call_runtime("FR0_boolean_invert");
 }
 
-void generator::goto_line(const int& i) const {
+void generator::goto_line(const int& i) {
+	if (!stack_for.empty())
+	{
+		stack_for.top().scope.escapes = true;
+	}
+	jump_targets.insert(i);
+	statement_terminates = true;
 	synth.synth(false) << "; Go to line " << i << E_;
 	synth.synth() << "jmp " << token(token_provider::TOKENS::LINE_INDICATOR) << i << E_;
 }
 
-void generator::gosub(const int& i) const {
+void generator::gosub(const int& i) {
+	if (!stack_for.empty())
+	{
+		stack_for.top().calls = true;
+		stack_for.top().scope.escapes = true;
+	}
+	jump_targets.insert(i);
+	procedures[current_procedure()].subroutines = true;
 	synth.synth(false) << "; Go sub line " << i << E_;
 	synth.synth() << "jsr " << token(token_provider::TOKENS::LINE_INDICATOR) << i << E_;
 }
 
-void generator::gosub(const std::string& s) const {
+void generator::gosub(const std::string& s) {
+	if (!stack_for.empty())
+	{
+		stack_for.top().calls = true;
+		stack_for.top().scope.calls.insert(s);
+	}
+	procedures[current_procedure()].calls.insert(s);
 	synth.synth(false) << "; Go sub procedure " << s << E_;
 	synth.synth() << "jsr " << token(token_provider::TOKENS::PROCEDURE) << s << E_;
 }
@@ -372,40 +1987,180 @@ void generator::write_runtime() const {
 
 void generator::sound()
 {
+	// Constant voice selects the registers at compile time. Nothing
+	// can be on the stack then, since the voice is below the rest.
+	int voice;
+	const bool constant_voice = (operands.size() >= 4) && get_constant(operands[operands.size() - 4], voice);
+	if (!constant_voice)
+	{
+		flush_operands();
+	}
 	if(!pokey_initialized)
 	{
 		pokey_initialized = true;
-		synth.synth() << "jsr POKEY_INIT" << E_;
+		call_runtime("POKEY_INIT");
+	}
+	if (!constant_voice)
+	{
+		call_runtime("SOUND");
+		drop_operands(4);
+		return;
+	}
+
+	const auto volume = take_operand();
+	const auto distortion = take_operand();
+	const auto pitch = take_operand();
+	drop_operands(1);
+	const int offset = (voice * 2) & 0xFF;
+	synth.synth() << "lda " << pitch.get_byte(0) << E_;
+	synth.synth() << "sta AUDF1+" << offset << E_;
+	int d;
+	int v;
+	if (get_constant(distortion, d) && get_constant(volume, v))
+	{
+		synth.synth() << "lda #" << (((d << 4) ^ v) & 0xFF) << E_;
+	}
+	else
+	{
+		synth.synth() << "lda " << distortion.get_byte(0) << E_;
+		synth.synth() << ":4 asl" << E_;
+		synth.synth() << "eor " << volume.get_byte(0) << E_;
+	}
+	synth.synth() << "sta AUDC1+" << offset << E_;
+}
+
+void generator::poke() {
+	// Constant address is stored to directly
+	int address;
+	if ((operands.size() >= 2) && get_constant(operands[operands.size() - 2], address))
+	{
+		const auto value = take_operand();
+		drop_operands(1);
+		synth.synth() << "lda " << get_operand_byte(value, 0) << E_;
+		synth.synth() << "sta " << address << E_;
+		if (value.is_on_stack())
+		{
+			synth.synth() << "dex" << E_;
+		}
+		return;
 	}
-	synth.synth() << "jsr SOUND" << E_;
+
+	// Address stepped by the loop is used through its slot
+	if ((operands.size() >= 2) && (operand::PLACE::INDUCTION == operands[operands.size() - 2].get_place()))
+	{
+		const auto value = take_operand();
+		const auto slot = take_operand();
+		note_block_store(slot.get_value(), value, 1);
+		synth.synth() << "mwa " << slot.get_value() << " FR1" << E_;
+		synth.synth() << "ldy #0" << E_;
+		synth.synth() << "lda " << get_operand_byte(value, 0) << E_;
+		synth.synth() << "sta (FR1),y" << E_;
+		if (value.is_on_stack())
+		{
+			synth.synth() << "dex" << E_;
+		}
+		return;
+	}
+	flush_operands();
+	call_runtime("POKE");
+	drop_operands(2);
 }
 
-void generator::poke() const {
-	synth.synth() << "jsr POKE" << E_;
+void generator::dpoke() {
+	int address;
+	if ((operands.size() >= 2) && get_constant(operands[operands.size() - 2], address))
+	{
+		const auto value = take_operand();
+		drop_operands(1);
+		load_operand(value, std::to_string(address));
+		return;
+	}
+	if ((operands.size() >= 2) && (operand::PLACE::INDUCTION == operands[operands.size() - 2].get_place()))
+	{
+		const auto value = take_operand();
+		const auto slot = take_operand();
+		note_block_store(slot.get_value(), value, 2);
+		synth.synth() << "mwa " << slot.get_value() << " FR1" << E_;
+		synth.synth() << "ldy #0" << E_;
+		synth.synth() << "lda " << get_operand_byte(value, 0) << E_;
+		synth.synth() << "sta (FR1),y" << E_;
+		synth.synth() << "iny" << E_;
+		synth.synth() << "lda " << get_operand_byte(value, 1) << E_;
+		synth.synth() << "sta (FR1),y" << E_;
+		if (value.is_on_stack())
+		{
+			synth.synth() << "dex" << E_;
+		}
+		return;
+	}
+	flush_operands();
+	call_runtime("DPOKE");
+	drop_operands(2);
 }
 
-void generator::dpoke() const {
-	synth.synth() << "jsr DPOKE" << E_;
+void generator::peek() {
+	int address;
+	if (!operands.empty() && get_constant(operands.back(), address))
+	{
+		drop_operands(1);
+		release_FR0();
+		synth.synth() << "lda " << address << E_;
+		synth.synth() << "sta FR0" << E_;
+		synth.synth() << "lda #0" << E_;
+		synth.synth() << "sta FR0+1" << E_;
+		operands.emplace_back(operand::PLACE::FR0, "", true);
+		return;
+	}
+	flush_operands();
+	call_runtime("PEEK");
+	operands.back() = operand(operand::PLACE::STACK, "", true);
 }
 
-void generator::peek() const {
-	synth.synth() << "jsr PEEK" << E_;
+void generator::dpeek() {
+	int address;
+	if (!operands.empty() && get_constant(operands.back(), address))
+	{
+		drop_operands(1);
+		release_FR0();
+		synth.synth() << "mwa " << address << " FR0" << E_;
+		operands.emplace_back(operand::PLACE::FR0);
+		return;
+	}
+	flush_operands();
+	call_runtime("DPEEK");
 }
 
-void generator::dpeek() const {
-	synth.synth() << "jsr DPEEK" << E_;
+void generator::stick() {
+	read_port("STICK");
 }
 
-void generator::stick() const {
-	synth.synth() << "jsr STICK" << E_;
+void generator::strig() {
+	read_port("STRIG");
 }
 
-void generator::strig() const {
-	synth.synth() << "jsr STRIG" << E_;
+// Constant port number is resolved at compile time
+void generator::read_port(const std::string& port) {
+	int number;
+	if (!operands.empty() && get_constant(operands.back(), number))
+	{
+		drop_operands(1);
+		release_FR0();
+		synth.synth() << "lda " << port << "0+" << (number & 0xFF) << E_;
+		synth.synth() << "sta FR0" << E_;
+		synth.synth() << "lda #0" << E_;
+		synth.synth() << "sta FR0+1" << E_;
+		operands.emplace_back(operand::PLACE::FR0, "", true);
+		return;
+	}
+	flush_operands();
+	call_runtime(port);
+	operands.back() = operand(operand::PLACE::STACK, "", true);
 }
 
 void generator::after_if()
 {
+	flush_operands();
+	statement_terminates = false;
 	// If this particular if didn't have ELSE statement, we need
 	// to synth it just before the ENDIF
 	if(ifs_with_else.find(stack_if.top()) == ifs_with_else.end())
@@ -418,6 +2173,8 @@ void generator::after_if()
 
 void generator::inside_if()
 {
+	flush_operands();
+	statement_terminates = false;
 	synth.synth() << "jmp " << token(token_provider::TOKENS::AFTER_IF_INDICATOR) << stack_if.top() << E_;
 	synth.synth(false) << token(token_provider::TOKENS::INSIDE_IF_INDICATOR) << stack_if.top() << E_;
 	ifs_with_else.insert(stack_if.top());
@@ -425,128 +2182,317 @@ void generator::inside_if()
 
 void generator::skip_if_on_false()
 {
-	pop_to("FR0");
+	if (!stack_for.empty())
+	{
+		stack_for.top().block.branches = true;
+	}
 	stack_if.push(counter_after_if++);
+	statement_terminates = false;
 	synth.synth(false) << "; Skip execution if logical value is false " << E_;
-	synth.synth() << "jsr Is_FR0_true" << E_;
-	synth.synth() << "cmp #0" << E_;
-	synth.synth() << "jeq " << token(token_provider::TOKENS::INSIDE_IF_INDICATOR) << (counter_after_if - 1) << E_;
+	branch_on(false, token(token_provider::TOKENS::INSIDE_IF_INDICATOR) + std::to_string(stack_if.top()));
 }
 
-void generator::for_loop_condition()
+void generator::skip_if_on_false(const COMPARISON& c)
 {
-	last_generic_label = get_next_generic_label();
-
-	pop_to("FR0");
-	push_from("FR0", generator::STACK::FOR_CONDITION);
+	if (!stack_for.empty())
+	{
+		stack_for.top().block.branches = true;
+	}
+	stack_if.push(counter_after_if++);
+	statement_terminates = false;
+	synth.synth(false) << "; Skip execution if comparison is false " << E_;
+	branch_on(c, false, token(token_provider::TOKENS::INSIDE_IF_INDICATOR) + std::to_string(stack_if.top()));
+}
 
-	synth.synth() << "mwa #" << last_generic_label << " FR0" << E_;
-	push_from("FR0", generator::STACK::RETURN_ADDRESS_STACK);
+void generator::for_loop_condition()
+{
+	stack_for.top().limit = take_for_loop_parameter(token_provider::TOKENS::FOR_LIMIT);
 }
 
-void generator::for_step(bool default_step) const {
-	if (default_step)
+void generator::for_step(bool default_step) {
+	if (!default_step)
 	{
-		// Use "1"
-		synth.synth() << "mwa #1 FR0" << E_;
+		stack_for.top().step = take_for_loop_parameter(token_provider::TOKENS::FOR_STEP);
 	}
-	else
+	flush_operands();
+
+	// Induction slots, if the body turns out to have any, are
+	// initialized by the routine emitted after the loop
+	auto& loop = stack_for.top();
+	int step;
+	loop.inductive = !loop.dynamic && get_constant(loop.step, step);
+	if (loop.inductive)
+	{
+		if (1 == step)
+		{
+			loop.block.statements = 0;
+			synth.synth(false) << ".if " << token(token_provider::TOKENS::FOR_BLOCK_OPERATION_USED) << loop.id << E_;
+			synth.synth() << "jmp " << token(token_provider::TOKENS::FOR_BLOCK_OPERATION) << loop.id << E_;
+			synth.synth(false) << ".endif" << E_;
+		}
+		synth.synth(false) << ".if " << token(token_provider::TOKENS::FOR_INDUCTION_VALID) << loop.id << E_;
+		synth.synth() << "jsr " << token(token_provider::TOKENS::FOR_INDUCTION_INIT) << loop.id << E_;
+		synth.synth(false) << ".endif" << E_;
+	}
+	if (loop.dynamic)
 	{
-		// Calculated value is on the expression stack
-		pop_to("FR0");
+		push_for_frame(loop);
 	}
-	push_from("FR0", generator::STACK::FOR_STEP);
-	synth.synth(false) << last_generic_label << E_;
+	synth.synth(false) << token(token_provider::TOKENS::FOR_INDICATOR) << loop.id << E_;
 }
 
 void generator::for_loop_counter(const std::string& counting_variable)
 {
 	loop_context.push(LOOP_CONTEXT::FOR);
-	synth.synth() << "mwa #" << token(token_provider::TOKENS::VARIABLE) + counting_variable << " FR0" << E_;
-	push_from("FR0", generator::STACK::FOR_COUNTER);
+	const auto id = counter_for++;
+	stack_for.push({
+		id,
+		token(token_provider::TOKENS::VARIABLE) + counting_variable,
+		operand(operand::PLACE::IMMEDIATE, "0"),
+		operand(operand::PLACE::IMMEDIATE, "1"),
+		false,
+		{},
+		{},
+		false,
+		block_operation(),
+		dynamic_loops.count(id) > 0,
+		{ current_procedure(), false, {}, {} } });
+}
+
+// Constant limit or step is used as immediate, anything
+// else is evaluated once and kept in a slot of the loop
+operand generator::take_for_loop_parameter(const token_provider::TOKENS& slot_token)
+{
+	const auto o = take_operand();
+	int value;
+	if (get_constant(o, value))
+	{
+		return o;
+	}
+	const auto slot = token(slot_token) + std::to_string(stack_for.top().id);
+	for_loop_slots.push_back(slot);
+	load_operand(o, slot);
+	return operand(operand::PLACE::VARIABLE, slot);
 }
 
-std::string generator::get_next_generic_label()
+std::string generator::get_for_frame_field(int offset) const
 {
-	return (boost::format("%1%_%2%") % token(token_provider::TOKENS::GENERIC_LABEL) % counter_generic_label++).str();
+	return token(token_provider::TOKENS::FOR_FRAMES) + '+' + token(token_provider::TOKENS::FOR_FRAMES_CAPACITY) + '*' + std::to_string(offset);
 }
 
-void generator::next()
+// Frame holds the address of the counter, the limit, the step and
+// the address the loop goes on from, byte by byte in separate rows
+void generator::push_for_frame(const for_loop& loop)
 {
-	// Peek loop counter
-	peek_to("FR1", generator::STACK::FOR_COUNTER);
+	for_frames_used = true;
+	const auto& top = token(token_provider::TOKENS::FOR_FRAMES_TOP);
+	const auto start = token(token_provider::TOKENS::FOR_INDICATOR) + std::to_string(loop.id);
+	const std::vector<std::string> bytes = {
+		"#<" + loop.counter, "#>" + loop.counter,
+		loop.limit.get_byte(0), loop.limit.get_byte(1),
+		loop.step.get_byte(0), loop.step.get_byte(1),
+		"#<" + start, "#>" + start };
+	synth.synth(false) << "; Push the frame of the loop" << E_;
+	synth.synth() << "ldy " << top << E_;
+	for (std::size_t i = 0; i < bytes.size(); ++i)
+	{
+		synth.synth() << "lda " << bytes[i] << E_;
+		synth.synth() << "sta " << get_for_frame_field(static_cast<int>(i)) << ",y" << E_;
+	}
+	synth.synth() << "iny" << E_;
+	synth.synth() << "tya" << E_;
+	synth.synth() << "and #" << token(token_provider::TOKENS::FOR_FRAMES_CAPACITY) << "-1" << E_;
+	synth.synth() << "sta " << top << E_;
+}
 
-	// Peek loop step
-	peek_to("FR0", generator::STACK::FOR_STEP);
+// Steps the loop on top of the frame stack. It goes on
+// from the address left in FR1 when carry is set.
+void generator::next_for_frame()
+{
+	for_frames_used = true;
+	call_runtime("FOR_NEXT");
+	synth.synth() << "jcs FOR_NEXT_REPEAT" << E_;
+}
 
-	// Increase loop counter
-	synth.synth() << "ldy #0" << E_;
-	synth.synth() << "adw (FR1),y FR0,y (FR1),y" << E_;
+// Loops which the first pass found dynamic
+std::set<int> generator::get_dynamic_loops() const
+{
+	std::set<int> result;
+	for (const auto& f : for_scopes)
+	{
+		const auto& s = f.second;
+		const auto entered = std::any_of(s.lines.begin(), s.lines.end(), [this](int l) { return jump_targets.count(l) > 0; });
+		const auto reentered = std::any_of(s.calls.begin(), s.calls.end(), [&](const std::string& p) {
+			return (p == s.procedure) || (reachable_procedures(p).count(s.procedure) > 0);
+		});
+		if (s.escapes || entered || reentered)
+		{
+			result.insert(f.first);
+		}
+	}
+	return result;
+}
 
-	// Move the counter value into FR0
-	synth.synth() << "ldy #0" << E_;
-	synth.synth() << "mwa (FR1),y FR0" << E_;
+void generator::set_dynamic_loops(const std::set<int>& l)
+{
+	dynamic_loops = l;
+}
 
-	// Peek loop condition
-	peek_to("FR1", generator::STACK::FOR_CONDITION);
+std::string generator::get_next_generic_label()
+{
+	return (boost::format("%1%_%2%") % token(token_provider::TOKENS::GENERIC_LABEL) % counter_generic_label++).str();
+}
 
-	// Compare (less or equal)
-	compare_greater();
-	FR0_boolean_invert();
+void generator::next()
+{
+	flush_operands();
 
-	// If less then peek address from RETURN_ADDRESS_STACK and jump
-	synth.synth() << "lda FR0" << E_;
-	synth.synth() << "cmp #1" << E_;
-	synth.synth() << "bne @+" << E_;
-	peek_to("FR1", generator::STACK::RETURN_ADDRESS_STACK);
+	// NEXT of a loop left by GOTO goes on with whatever loop is
+	// on top of the frame stack, just like the interpreter does
+	if (stack_for.empty())
+	{
+		next_for_frame();
+		return;
+	}
+	const auto loop = stack_for.top();
+	note_use(loop.counter);
+	note_use(loop.counter);
+	for (const auto& parameter : { loop.limit, loop.step })
+	{
+		if (operand::PLACE::VARIABLE == parameter.get_place())
+		{
+			note_use(parameter.get_value());
+		}
+	}
+	stack_for.pop();
+	loop_context.pop();
 
-	//synth.synth() << "jmp (FR1)" << E_;		// DONE: Make safer jump via rts
-	synth.synth() << R"(
-	sbw FR1 #1
-	lda FR1+1
-	pha
-	lda FR1
-	pha
-	rts
-)";
+	// Whatever the inner loop changed, changes in the outer one too
+	if (!stack_for.empty())
+	{
+		auto& outer = stack_for.top();
+		outer.assigned.insert(loop.assigned.begin(), loop.assigned.end());
+		outer.assigned.insert(loop.counter);
+		outer.calls = outer.calls || loop.calls;
+		outer.block.branches = true;
+		outer.scope.escapes = outer.scope.escapes || loop.scope.escapes;
+		outer.scope.calls.insert(loop.scope.calls.begin(), loop.scope.calls.end());
+		outer.scope.lines.insert(loop.scope.lines.begin(), loop.scope.lines.end());
+	}
+	for_scopes[loop.id] = loop.scope;
+	if (loop.dynamic)
+	{
+		note_loop_range(loop);
+		next_for_frame();
+		synth.synth(false) << token(token_provider::TOKENS::AFTER_FOR_INDICATOR) << loop.id << E_;
+		return;
+	}
+	const bool valid = inductions_valid(loop);
 
-	// Otherwise quick-pop addresses from three related stacks and continue
-	loop_context.pop();
-	synth.synth(false) << "@" << E_;
-	synth.synth() << "jsr CLEAR_FOR_LOOP_STACKS" << E_;
-}
+	// Increase loop counter
+	note_loop_range(loop);
+	const bool byte_counter = byte_variables.count(loop.counter) > 0;
+	int step;
+	if (get_constant(loop.step, step) && 1 == step)
+	{
+		synth.synth() << (byte_counter ? "inc " : "inw ") << loop.counter << E_;
+	}
+	else if (byte_counter)
+	{
+		synth.synth() << "clc" << E_;
+		synth.synth() << "lda " << loop.counter << E_;
+		synth.synth() << "adc " << loop.step.get_byte(0) << E_;
+		synth.synth() << "sta " << loop.counter << E_;
+	}
+	else
+	{
+		synth.synth() << "clc" << E_;
+		for (int i = 0; i < 2; ++i)
+		{
+			synth.synth() << "lda " << loop.counter << (i ? "+1" : "") << E_;
+			synth.synth() << "adc " << loop.step.get_byte(i) << E_;
+			synth.synth() << "sta " << loop.counter << (i ? "+1" : "") << E_;
+		}
+	}
 
-void generator::register_generator_runtime() const
-{
-	// TODO: Rework this "get_indent()-crap. Consider enabling synth() to user-provided streams.
-	std::stringstream ss;
-	ss << "CLEAR_FOR_LOOP_STACKS" << E_;
-	ss << cfg.get_indent() << "mwa #" << stacks.at(STACK::FOR_COUNTER).get_pointer() << ' ' << token(token_provider::TOKENS::PUSH_POP_PTR_TO_INC_DEC) << E_;
-	ss << cfg.get_indent() << "jsr FAKE_POP" << E_;
-	ss << cfg.get_indent() << "mwa #" << stacks.at(STACK::FOR_CONDITION).get_pointer() << ' ' << token(token_provider::TOKENS::PUSH_POP_PTR_TO_INC_DEC) << E_;
-	ss << cfg.get_indent() << "jsr FAKE_POP" << E_;
-	ss << cfg.get_indent() << "mwa #" << stacks.at(STACK::RETURN_ADDRESS_STACK).get_pointer() << ' ' << token(token_provider::TOKENS::PUSH_POP_PTR_TO_INC_DEC) << E_;
-	ss << cfg.get_indent() << "jsr FAKE_POP" << E_;
-	ss << cfg.get_indent() << "mwa #" << stacks.at(STACK::FOR_STEP).get_pointer() << ' ' << token(token_provider::TOKENS::PUSH_POP_PTR_TO_INC_DEC) << E_;
-	ss << cfg.get_indent() << "jsr FAKE_POP" << E_;
-	ss << cfg.get_indent() << "rts" << E_;
+	// Induction slots follow the counter
+	if (valid)
+	{
+		for (const auto& slot : loop.induction_slots)
+		{
+			const int delta = (slot.second.coefficient * step) & 0xFFFF;
+			if (1 == delta)
+			{
+				synth.synth() << "inw " << slot.first << E_;
+			}
+			else if (0 != delta)
+			{
+				synth.synth() << "adw " << slot.first << " #" << delta << E_;
+			}
+		}
+	}
 
-	cfg.get_runtime()->register_own_runtime_funtion(ss.str());
+	// Loop again while counter is less or equal to the limit
+	if (byte_counter)
+	{
+		synth.synth() << "lda " << loop.limit.get_byte(0) << E_;
+		synth.synth() << "cmp " << loop.counter << E_;
+	}
+	else
+	{
+		compare_words(loop.limit.get_byte(0), loop.limit.get_byte(1), loop.counter, loop.counter + "+1");
+	}
+	synth.synth() << "jcs " << token(token_provider::TOKENS::FOR_INDICATOR) << loop.id << E_;
+
+	const bool block = is_block_operation(loop);
+	if (loop.inductive)
+	{
+		synth.synth(false) << token(token_provider::TOKENS::FOR_INDUCTION_VALID) << loop.id << " equ " << (valid ? 1 : 0) << E_;
+	}
+	if (loop.block.statements >= 0)
+	{
+		synth.synth(false) << token(token_provider::TOKENS::FOR_BLOCK_OPERATION_USED) << loop.id << " equ " << (block ? 1 : 0) << E_;
+	}
+	if (valid || block)
+	{
+		synth.synth() << "jmp " << token(token_provider::TOKENS::AFTER_FOR_INDICATOR) << loop.id << E_;
+	}
+	if (valid)
+	{
+		synth.synth(false) << token(token_provider::TOKENS::FOR_INDUCTION_INIT) << loop.id << E_;
+		for (const auto& slot : loop.induction_slots)
+		{
+			compute_induction(slot.second, slot.first);
+		}
+		synth.synth() << "rts" << E_;
+	}
+	if (block)
+	{
+		write_block_operation(loop);
+	}
+	synth.synth(false) << token(token_provider::TOKENS::AFTER_FOR_INDICATOR) << loop.id << E_;
 }
 
 void generator::while_()
 {
+	flush_operands();
 	loop_context.push(LOOP_CONTEXT::WHILE);
 	stack_while.push(counter_while++);
 	synth.synth(false) << token(token_provider::TOKENS::WHILE_INDICATOR) << stack_while.top() << E_;
 }
 
+// Body is marked, so that the test can be repeated at the bottom
+// of the loop once the optimizer rotates it
 void generator::while_condition()
 {
-	pop_to("FR0");
-	synth.synth() << "jsr Is_FR0_true" << E_;
-	synth.synth() << "cmp #0" << E_;
-	synth.synth() << "jeq " << token(token_provider::TOKENS::AFTER_WHILE_INDICATOR) << stack_while.top() << E_;
+	branch_on(false, token(token_provider::TOKENS::AFTER_WHILE_INDICATOR) + std::to_string(stack_while.top()));
+	synth.synth(false) << token(token_provider::TOKENS::WHILE_BODY_INDICATOR) << stack_while.top() << E_;
+}
+
+void generator::while_condition(const COMPARISON& c)
+{
+	branch_on(c, false, token(token_provider::TOKENS::AFTER_WHILE_INDICATOR) + std::to_string(stack_while.top()));
+	synth.synth(false) << token(token_provider::TOKENS::WHILE_BODY_INDICATOR) << stack_while.top() << E_;
 }
 
 void generator::wend()
@@ -565,7 +2511,16 @@ void generator::exit()
 	case LOOP_CONTEXT::OUTSIDE:
 		throw std::runtime_error("EXIT found outside the loop");
 	case LOOP_CONTEXT::FOR:
-		synth.synth() << "jmp @+" << E_;
+		if (stack_for.top().dynamic)
+		{
+			const auto& top = token(token_provider::TOKENS::FOR_FRAMES_TOP);
+			synth.synth() << "ldy " << top << E_;
+			synth.synth() << "dey" << E_;
+			synth.synth() << "tya" << E_;
+			synth.synth() << "and #" << token(token_provider::TOKENS::FOR_FRAMES_CAPACITY) << "-1" << E_;
+			synth.synth() << "sta " << top << E_;
+		}
+		synth.synth() << "jmp " << token(token_provider::TOKENS::AFTER_FOR_INDICATOR) << stack_for.top().id << E_;
 		break;
 	case LOOP_CONTEXT::WHILE:
 		synth.synth() << "jmp " << token(token_provider::TOKENS::AFTER_WHILE_INDICATOR) << stack_while.top() << E_;
@@ -583,6 +2538,7 @@ void generator::exit()
 
 void generator::repeat()
 {
+	flush_operands();
 	loop_context.push(LOOP_CONTEXT::REPEAT);
 	stack_repeat.push(counter_repeat++);
 	synth.synth(false) << token(token_provider::TOKENS::REPEAT_INDICATOR) << stack_repeat.top() << E_;
@@ -590,16 +2546,21 @@ void generator::repeat()
 
 void generator::until()
 {
-	pop_to("FR0");
-	synth.synth() << "jsr Is_FR0_true" << E_;
-	synth.synth() << "cmp #0" << E_;
-	synth.synth() << "jeq " << token(token_provider::TOKENS::REPEAT_INDICATOR) << stack_repeat.top() << E_;
+	branch_on(false, token(token_provider::TOKENS::REPEAT_INDICATOR) + std::to_string(stack_repeat.top()));
+	synth.synth(false) << token(token_provider::TOKENS::AFTER_REPEAT_INDICATOR) << stack_repeat.top() << E_;
+	stack_repeat.pop();
+}
+
+void generator::until(const COMPARISON& c)
+{
+	branch_on(c, false, token(token_provider::TOKENS::REPEAT_INDICATOR) + std::to_string(stack_repeat.top()));
 	synth.synth(false) << token(token_provider::TOKENS::AFTER_REPEAT_INDICATOR) << stack_repeat.top() << E_;
 	stack_repeat.pop();
 }
 
 void generator::do_()
 {
+	flush_operands();
 	loop_context.push(LOOP_CONTEXT::DO);
 	stack_do.push(counter_do++);
 	synth.synth(false) << token(token_provider::TOKENS::DO_INDICATOR) << stack_do.top() << E_;
@@ -612,39 +2573,74 @@ void generator::loop()
 	stack_do.pop();
 }
 
-void generator::return_() const {
+void generator::return_() {
 	synth.synth() << "rts" << E_;
+	statement_terminates = true;
 }
 
+// PROC the code above can fall into, or one still open
+// when the next begins, does not share its variables
 void generator::proc(const std::string& s)
 {
+	flush_operands();
+	auto& p = procedures[s];
+	p.overlappable = p.overlappable && previous_statement_terminates && (0 == nesting());
+	p.lines.insert(current_line);
+	if (!stack_procedure.empty())
+	{
+		procedures[stack_procedure.top()].overlappable = false;
+		stack_procedure.pop();
+	}
 	stack_procedure.push(s);
+	procedure_nesting = nesting();
 	synth.synth(false) << token(token_provider::TOKENS::PROCEDURE) << s << E_;
 }
 
-void generator::end() const
+// Only ENDPROC at the level of the PROC itself closes it
+void generator::endproc()
+{
+	return_();
+	if (!stack_procedure.empty() && (nesting() == procedure_nesting))
+	{
+		stack_procedure.pop();
+	}
+}
+
+void generator::end()
 {
 	synth.synth() << "jmp " << token(token_provider::TOKENS::PROGRAM_END) << E_;
+	statement_terminates = true;
 }
 
 void generator::print_newline() const
 {
-	synth.synth() << "jsr PUTNEWLINE" << E_;
+	call_runtime("PUTNEWLINE");
 }
 
 void generator::print_comma() const
 {
-	synth.synth() << "jsr PUTCOMMA" << E_;
+	call_runtime("PUTCOMMA");
 }
 
-void generator::init_integer_array(const basic_array& arr) const
+void generator::init_integer_array(const basic_array& arr)
+{
+	arrays[arr.get_name()] = arr;
+}
+
+void generator::register_array_header(const basic_array& arr) const
 {
 	// TODO: Check whether such array has already been declared
 	// TODO: Rework this "get_indent()-crap. Consider enabling synth() to user-provided streams.
 	std::stringstream ss;
 	ss << get_array_token(arr.get_name()) << E_;
 	ss << cfg.get_indent() << "dta a(" << arr.get_size(0)+1 << "),a(" << arr.get_size(1)+1 << ')' << E_;
-	ss << ':' << ((arr.get_size(0)+1)*(arr.get_size(1)+1)) << cfg.get_indent() << cfg.get_number_interpretation()->get_initializer() << E_;
+	if (has_row_table(arr))
+	{
+		ss << get_array_token(arr.get_name()) << "_ROWS_LO" << E_;
+		ss << ':' << arr.get_size(1)+1 << cfg.get_indent() << "dta l(#*" << get_row_stride(arr) << ')' << E_;
+		ss << get_array_token(arr.get_name()) << "_ROWS_HI" << E_;
+		ss << ':' << arr.get_size(1)+1 << cfg.get_indent() << "dta h(#*" << get_row_stride(arr) << ')' << E_;
+	}
 
 	cfg.get_runtime()->register_own_runtime_funtion(ss.str());
 }
@@ -654,8 +2650,15 @@ std::string generator::get_array_token(const std::string& name) const
 	return token(token_provider::TOKENS::INTEGER_ARRAY) + name;
 }
 
-void generator::put_zero_in_FR0() const
+// Elements live apart from the header, among the uninitialized data
+std::string generator::get_elements_token(const std::string& name) const
+{
+	return get_array_token(name) + "_ELEMENTS";
+}
+
+void generator::put_zero_in_FR0()
 {
-	synth.synth() << "jsr PUT_ZERO_IN_FR0" << E_;
+	release_FR0();
+	call_runtime("PUT_ZERO_IN_FR0");
 }
 
@@ -0,0 +1,65 @@
+/*
+ *
+ * Turbo Basic Compiler by mgr_inz_rafal.
+ *
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <rchabowski@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ *														// mgr inz. Rafal
+ * ----------------------------------------------------------------------------
+ */
+
+#include "operand.h"
+
+#include <stdexcept>
+
+operand::operand(PLACE _place, const std::string& _value, bool _byte):
+	place(_place),
+	value(_value),
+	byte(_byte)
+{}
+
+operand::PLACE operand::get_place() const
+{
+	return place;
+}
+
+const std::string& operand::get_value() const
+{
+	return value;
+}
+
+bool operand::is_on_stack() const
+{
+	return PLACE::STACK == place;
+}
+
+bool operand::is_in_FR0() const
+{
+	return PLACE::FR0 == place;
+}
+
+bool operand::is_byte() const
+{
+	return byte;
+}
+
+// Returns the assembler source of the given byte (0 - low, 1 - high).
+// Operands placed on the stack are addressed by the caller,
+// induction values need to be materialized first.
+std::string operand::get_byte(int which) const
+{
+	switch(place)
+	{
+	case PLACE::FR0:
+		return which ? "FR0+1" : "FR0";
+	case PLACE::VARIABLE:
+		return which ? value + "+1" : value;
+	case PLACE::IMMEDIATE:
+		return (which ? "#>" : "#<") + value;
+	default:
+		throw std::logic_error("operand has no fixed address");
+	}
+}
@@ -0,0 +1,956 @@
+/*
+ *
+ * Turbo Basic Compiler by mgr_inz_rafal.
+ *
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <rchabowski@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ *														// mgr inz. Rafal
+ * ----------------------------------------------------------------------------
+ */
+#include "optimizer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <iterator>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+optimizer::optimizer(std::istream& in, const token_provider& _tp):
+	tp(_tp)
+{
+	append(in);
+
+	const std::set<std::string> setting_flags = {
+		"lda", "ldx", "ldy", "cmp", "cpx", "cpy", "and", "ora", "eor", "adc", "sbc",
+		"inx", "iny", "dex", "dey", "tax", "tay", "txa", "tya", "pla"
+	};
+	peephole_rules = {
+		{ "store-reload",	{ "sta $1", "lda $1" },	{ "sta $1" },	setting_flags },
+		{ "store-reload",	{ "stx $1", "ldx $1" },	{ "stx $1" },	setting_flags },
+		{ "store-reload",	{ "sty $1", "ldy $1" },	{ "sty $1" },	setting_flags },
+		{ "dead-load",		{ "lda $1", "lda $2" },	{ "lda $2" },	{} },
+		{ "dead-load",		{ "ldx $1", "ldx $2" },	{ "ldx $2" },	{} },
+		{ "dead-load",		{ "ldy $1", "ldy $2" },	{ "ldy $2" },	{} },
+		{ "repeated-store",	{ "sta $1", "sta $1" },	{ "sta $1" },	{} },
+		{ "repeated-store",	{ "stx $1", "stx $1" },	{ "stx $1" },	{} },
+		{ "repeated-store",	{ "sty $1", "sty $1" },	{ "sty $1" },	{} },
+		{ "push-pop",		{ "inx", "dex", "lda $1" },	{ "lda $1" },	{} },
+	};
+}
+
+// Code generated after some passes have already run
+void optimizer::append(std::istream& in)
+{
+	std::string text;
+	while (std::getline(in, text))
+	{
+		lines.push_back(parse(text));
+	}
+}
+
+// Names used by the lines left, directives included
+std::set<std::string> optimizer::referenced() const
+{
+	std::set<std::string> result;
+	for (const auto& l : lines)
+	{
+		if (l.removed || l.text.empty() || (';' == l.text[0]))
+		{
+			continue;
+		}
+		const auto opaque = l.label.empty() && l.operand.empty() && !std::isspace(static_cast<unsigned char>(l.text[0]));
+		for (const auto& name : identifiers(opaque ? l.text : l.operand))
+		{
+			result.insert(name);
+		}
+	}
+	return result;
+}
+
+optimizer::line optimizer::parse(const std::string& text)
+{
+	line l = { text, "", "", "", false };
+	std::istringstream s(text);
+	if (!text.empty() && !std::isspace(static_cast<unsigned char>(text[0])))
+	{
+		// Comments and directives are kept opaque
+		switch (text[0])
+		{
+		case ';':
+			return l;
+		case '.':
+		case ':':
+		case '#':
+			s >> l.mnemonic;
+			return l;
+		default:
+			s >> l.label;
+		}
+	}
+	s >> l.mnemonic;
+	std::getline(s >> std::ws, l.operand);
+	l.operand.erase(l.operand.find_last_not_of(" \t\r") + 1);
+	return l;
+}
+
+bool optimizer::is_identifier(const std::string& s)
+{
+	if (s.empty() || !(std::isalpha(static_cast<unsigned char>(s[0])) || '_' == s[0]))
+	{
+		return false;
+	}
+	for (const auto c : s)
+	{
+		if (!std::isalnum(static_cast<unsigned char>(c)) && '_' != c)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Conditional jumps are the MADS pseudo instructions,
+// which get the short branch whenever the target is in range
+bool optimizer::is_jump(const std::string& mnemonic)
+{
+	static const std::set<std::string> jumps = {
+		"jmp", "jsr", "jeq", "jne", "jcc", "jcs", "jmi", "jpl", "jvc", "jvs"
+	};
+	return jumps.count(mnemonic) > 0;
+}
+
+bool optimizer::is_branch(const std::string& mnemonic)
+{
+	static const std::set<std::string> branches = {
+		"beq", "bne", "bcc", "bcs", "bmi", "bpl", "bvc", "bvs"
+	};
+	return branches.count(mnemonic) > 0;
+}
+
+// Conditional jump taken in the opposite case, empty for any other mnemonic
+std::string optimizer::inverted_jump(const std::string& mnemonic)
+{
+	static const std::map<std::string, std::string> inverted = {
+		{ "eq", "ne" }, { "ne", "eq" }, { "cc", "cs" }, { "cs", "cc" },
+		{ "mi", "pl" }, { "pl", "mi" }, { "vc", "vs" }, { "vs", "vc" }
+	};
+	if ((3 != mnemonic.size()) || (('j' != mnemonic[0]) && ('b' != mnemonic[0])))
+	{
+		return "";
+	}
+	const auto it = inverted.find(mnemonic.substr(1));
+	return (it == inverted.end()) ? "" : 'j' + it->second;
+}
+
+// Lines that produce no code between a label and the instruction it marks
+bool optimizer::is_transparent(const line& l)
+{
+	return l.removed || l.mnemonic.empty() || "equ" == l.mnemonic;
+}
+
+void optimizer::index_labels()
+{
+	labels.clear();
+	aliases.clear();
+	std::set<std::string> ambiguous;
+	for (std::size_t i = 0; i < lines.size(); ++i)
+	{
+		const auto& l = lines[i];
+		if (l.label.empty())
+		{
+			continue;
+		}
+		if (!labels.emplace(l.label, i).second)
+		{
+			ambiguous.insert(l.label);
+		}
+		if ("equ" == l.mnemonic && is_identifier(l.operand))
+		{
+			aliases[l.label] = l.operand;
+		}
+	}
+	for (const auto& a : ambiguous)
+	{
+		labels.erase(a);
+		aliases.erase(a);
+	}
+}
+
+std::string optimizer::resolve_alias(const std::string& label) const
+{
+	auto result = label;
+	for (std::size_t i = 0; i <= aliases.size(); ++i)
+	{
+		const auto it = aliases.find(result);
+		if (it == aliases.end())
+		{
+			break;
+		}
+		result = it->second;
+	}
+	return result;
+}
+
+const optimizer::line* optimizer::first_instruction(const std::string& label) const
+{
+	const auto it = labels.find(resolve_alias(label));
+	if (it == labels.end() || "equ" == lines[it->second].mnemonic)
+	{
+		return nullptr;
+	}
+	for (auto i = it->second; i < lines.size(); ++i)
+	{
+		if (!is_transparent(lines[i]))
+		{
+			return &lines[i];
+		}
+	}
+	return nullptr;
+}
+
+// Follows the chain of unconditional jumps starting at the label
+std::string optimizer::final_target(const std::string& label) const
+{
+	auto target = label;
+	std::set<std::string> visited = { resolve_alias(label) };
+	for (;;)
+	{
+		const auto i = first_instruction(target);
+		if (!i || "jmp" != i->mnemonic || !is_identifier(i->operand) || !visited.insert(resolve_alias(i->operand)).second)
+		{
+			return target;
+		}
+		target = i->operand;
+	}
+}
+
+bool optimizer::falls_through_to(std::size_t index, const std::string& label) const
+{
+	const auto target = resolve_alias(label);
+	for (auto i = index + 1; i < lines.size(); ++i)
+	{
+		const auto& l = lines[i];
+		if (!l.removed && !l.label.empty() && "equ" != l.mnemonic && target == l.label)
+		{
+			return true;
+		}
+		if (!is_transparent(l))
+		{
+			return false;
+		}
+	}
+	return false;
+}
+
+void optimizer::set_instruction(line& l, const std::string& mnemonic, const std::string& operand)
+{
+	const auto indentation = l.label.empty() ? l.text.substr(0, l.text.find_first_not_of(" \t")) : l.label + ' ';
+	l.mnemonic = mnemonic;
+	l.operand = operand;
+	l.text = indentation + mnemonic + (operand.empty() ? "" : ' ' + operand);
+}
+
+// Jumps landing on another jump go straight to its target, a jump onto "rts"
+// returns right away and a jump to the very next instruction is dropped
+void optimizer::thread_jumps()
+{
+	index_labels();
+	for (auto& l : lines)
+	{
+		if (!is_jump(l.mnemonic) || !is_identifier(l.operand))
+		{
+			continue;
+		}
+		const auto target = final_target(l.operand);
+		if (target != l.operand)
+		{
+			set_instruction(l, l.mnemonic, target);
+		}
+		const auto i = first_instruction(target);
+		if ("jmp" == l.mnemonic && i && "rts" == i->mnemonic && i->operand.empty())
+		{
+			set_instruction(l, "rts", "");
+		}
+	}
+	for (std::size_t i = 0; i < lines.size(); ++i)
+	{
+		auto& l = lines[i];
+		if (is_jump(l.mnemonic) && "jsr" != l.mnemonic && l.label.empty() && falls_through_to(i, l.operand))
+		{
+			l.removed = true;
+		}
+	}
+}
+
+// Call with nothing but labels up to "rts" becomes a jump, so the callee returns
+// straight to our caller. The "rts" stays, other code may still jump to it.
+void optimizer::tail_calls()
+{
+	for (std::size_t i = 0; i < lines.size(); ++i)
+	{
+		auto& l = lines[i];
+		if (l.removed || "jsr" != l.mnemonic || !is_identifier(l.operand))
+		{
+			continue;
+		}
+		auto next = i + 1;
+		while ((next < lines.size()) && is_transparent(lines[next]))
+		{
+			++next;
+		}
+		if ((next < lines.size()) && ("rts" == lines[next].mnemonic) && lines[next].operand.empty())
+		{
+			set_instruction(l, "jmp", l.operand);
+		}
+	}
+}
+
+// WHILE loop is tested up to the body label, DO loop up to the first
+// jump out of it. The test is copied in place of the jump back to the
+// top, with its labels renamed and the branch to the exit inverted to
+// go to the body instead. Every way out of the test has to lead either
+// out of the loop or into the body.
+bool optimizer::rotate_loop(std::size_t back_jump, std::vector<line>& bottom) const
+{
+	const auto& jump = lines[back_jump];
+	const auto& head = jump.operand;
+	std::string body;
+	std::string exit;
+	const auto& while_indicator = tp.get(token_provider::TOKENS::WHILE_INDICATOR);
+	const auto& do_indicator = tp.get(token_provider::TOKENS::DO_INDICATOR);
+	if (0 == head.find(while_indicator))
+	{
+		const auto id = head.substr(while_indicator.size());
+		body = tp.get(token_provider::TOKENS::WHILE_BODY_INDICATOR) + id;
+		exit = tp.get(token_provider::TOKENS::AFTER_WHILE_INDICATOR) + id;
+	}
+	else if (0 == head.find(do_indicator))
+	{
+		exit = tp.get(token_provider::TOKENS::AFTER_DO_INDICATOR) + head.substr(do_indicator.size());
+	}
+	else
+	{
+		return false;
+	}
+	const auto top = labels.find(head);
+	if (!jump.label.empty() || (top == labels.end()) || (top->second >= back_jump) || !falls_through_to(back_jump, exit))
+	{
+		return false;
+	}
+
+	// Find the last instruction of the test
+	std::size_t last = 0;
+	std::size_t instructions = 0;
+	for (auto i = top->second + 1; i < back_jump; ++i)
+	{
+		const auto& l = lines[i];
+		if (!body.empty() && (body == l.label))
+		{
+			break;
+		}
+		if (!l.mnemonic.empty() && ('.' == l.mnemonic[0]))
+		{
+			return false;
+		}
+		if (is_transparent(l))
+		{
+			continue;
+		}
+		last = i;
+		++instructions;
+		if (body.empty() && ("jmp" == l.mnemonic) && (exit == resolve_alias(l.operand)))
+		{
+			break;
+		}
+	}
+	if (!last || (instructions > MAXIMUM_ROTATED_TEST))
+	{
+		return false;
+	}
+	const auto& final_jump = lines[last];
+	const auto continuation = body.empty() ? "" : inverted_jump(final_jump.mnemonic);
+	if ((exit != resolve_alias(final_jump.operand)) || (body.empty() ? ("jmp" != final_jump.mnemonic) : continuation.empty()))
+	{
+		return false;
+	}
+	auto start = last + 1;
+	while ((start < lines.size()) && is_transparent(lines[start]))
+	{
+		++start;
+	}
+
+	// Labels of the test get a copy, the ones right after it are the body
+	std::map<std::string, std::string> renamed;
+	for (auto i = top->second + 1; i <= last; ++i)
+	{
+		if (!lines[i].removed && !lines[i].label.empty())
+		{
+			renamed[lines[i].label] = lines[i].label + "_ROTATED";
+		}
+	}
+	for (auto i = top->second + 1; i <= last; ++i)
+	{
+		const auto& l = lines[i];
+		if ((!is_jump(l.mnemonic) && !is_branch(l.mnemonic)) || ("jsr" == l.mnemonic))
+		{
+			continue;
+		}
+		if (!is_identifier(l.operand))
+		{
+			return false;
+		}
+		const auto target = labels.find(resolve_alias(l.operand));
+		const auto inside = (target != labels.end()) && ("equ" != lines[target->second].mnemonic) &&
+			(target->second > top->second) && (target->second < start);
+		if (!inside && (exit != resolve_alias(l.operand)))
+		{
+			return false;
+		}
+	}
+
+	const auto indentation = jump.text.substr(0, jump.text.find_first_not_of(" \t"));
+	for (auto i = top->second + 1; i < last; ++i)
+	{
+		const auto& l = lines[i];
+		if (l.removed || (l.label.empty() && l.mnemonic.empty()))
+		{
+			continue;
+		}
+		auto operand = l.operand;
+		auto mnemonic = l.mnemonic;
+		const auto target = renamed.find(operand);
+		if (target != renamed.end())
+		{
+			operand = target->second;
+		}
+		else if (is_branch(mnemonic))
+		{
+			// Body may be out of reach of the short branch
+			mnemonic[0] = 'j';
+		}
+		const auto instruction = mnemonic + (operand.empty() ? "" : ' ' + operand);
+		bottom.push_back(parse(l.label.empty() ? indentation + instruction : renamed.at(l.label) + (mnemonic.empty() ? "" : ' ' + instruction)));
+	}
+	if (!body.empty())
+	{
+		bottom.push_back(parse(indentation + continuation + ' ' + body));
+	}
+	return true;
+}
+
+// Loops are tested at the bottom, so that the jump back to the
+// top is taken only once. The test at the top is entered only once.
+void optimizer::rotate_loops()
+{
+	index_labels();
+	std::map<std::size_t, std::vector<line>> bottoms;
+	for (std::size_t i = 0; i < lines.size(); ++i)
+	{
+		std::vector<line> bottom;
+		if (!lines[i].removed && ("jmp" == lines[i].mnemonic) && rotate_loop(i, bottom))
+		{
+			bottoms[i] = bottom;
+		}
+	}
+	std::vector<line> rotated;
+	for (std::size_t i = 0; i < lines.size(); ++i)
+	{
+		const auto bottom = bottoms.find(i);
+		if (bottom == bottoms.end())
+		{
+			rotated.push_back(lines[i]);
+			continue;
+		}
+		rotated.insert(rotated.end(), bottom->second.begin(), bottom->second.end());
+	}
+	lines.swap(rotated);
+}
+
+std::vector<std::string> optimizer::identifiers(const std::string& operand) const
+{
+	std::vector<std::string> result;
+	for (std::size_t i = 0; i < operand.size();)
+	{
+		const auto c = static_cast<unsigned char>(operand[i]);
+		if (!std::isalpha(c) && ('_' != c))
+		{
+			// Skip hexadecimal numbers, which may look like a name
+			i = ('$' == c) ? operand.find_first_not_of("0123456789abcdefABCDEF", i + 1) : i + 1;
+			i = std::min(i, operand.size());
+			continue;
+		}
+		auto end = i;
+		while ((end < operand.size()) && (std::isalnum(static_cast<unsigned char>(operand[end])) || ('_' == operand[end])))
+		{
+			++end;
+		}
+		result.push_back(operand.substr(i, end - i));
+		i = end;
+	}
+	return result;
+}
+
+// Program code no jump, call or fall through leads to is dropped, along
+// with its comments. Labels stay, so does everything outside the program
+// and any label used other than as a jump target is taken as reachable.
+// Jumps inside conditional assembly may not be there, so the line
+// following them is reachable too.
+void optimizer::remove_dead_code()
+{
+	index_labels();
+	const auto& program_start = tp.get(token_provider::TOKENS::PROGRAM_START);
+	const auto& program_end = tp.get(token_provider::TOKENS::PROGRAM_END);
+	std::size_t start = lines.size();
+	std::size_t end = lines.size();
+	for (std::size_t i = 0; i < lines.size(); ++i)
+	{
+		if ((start == lines.size()) && ("org" == lines[i].mnemonic) && (program_start == lines[i].operand))
+		{
+			start = i;
+		}
+		if ((start != lines.size()) && (program_end == lines[i].label))
+		{
+			end = i;
+			break;
+		}
+	}
+	if (end == lines.size())
+	{
+		return;
+	}
+
+	std::vector<std::size_t> pending = { start + 1 };
+	std::vector<int> nesting(lines.size(), 0);
+	int depth = 0;
+	for (std::size_t i = 0; i < lines.size(); ++i)
+	{
+		const auto& l = lines[i];
+		if ((i <= start) || (i >= end))
+		{
+			pending.push_back(i);
+		}
+		if (".endif" == l.mnemonic)
+		{
+			--depth;
+		}
+		nesting[i] = depth;
+		if (0 == l.mnemonic.find(".if"))
+		{
+			++depth;
+		}
+		if (l.removed)
+		{
+			continue;
+		}
+		if (is_jump(l.mnemonic) || is_branch(l.mnemonic))
+		{
+			if ((i > start) && (i < end) && !is_identifier(l.operand))
+			{
+				std::cout << std::endl << "*** DEAD CODE ELIMINATION ***" << std::endl;
+				std::cout << "Skipped, indirect jump in the program: " << l.mnemonic << ' ' << l.operand << std::endl;
+				return;
+			}
+			continue;
+		}
+		if (("equ" == l.mnemonic) && is_identifier(l.operand))
+		{
+			continue;
+		}
+		for (const auto& name : identifiers(l.operand))
+		{
+			const auto it = labels.find(resolve_alias(name));
+			if (it != labels.end())
+			{
+				pending.push_back(it->second);
+			}
+		}
+	}
+
+	std::vector<bool> reachable(lines.size(), false);
+	while (!pending.empty())
+	{
+		const auto i = pending.back();
+		pending.pop_back();
+		if ((i >= lines.size()) || reachable[i])
+		{
+			continue;
+		}
+		reachable[i] = true;
+		const auto& l = lines[i];
+		if (!l.removed && (is_jump(l.mnemonic) || is_branch(l.mnemonic)))
+		{
+			const auto target = labels.find(resolve_alias(l.operand));
+			if (target != labels.end())
+			{
+				pending.push_back(target->second);
+			}
+		}
+		const auto stops = !l.removed && (0 == nesting[i]) && (("jmp" == l.mnemonic) || ("rts" == l.mnemonic) || ("rti" == l.mnemonic));
+		if (!stops)
+		{
+			pending.push_back(i + 1);
+		}
+	}
+
+	int instructions = 0;
+	int bytes = 0;
+	for (auto i = start + 1; i < end; ++i)
+	{
+		auto& l = lines[i];
+		if (reachable[i] || l.removed || ("equ" == l.mnemonic) || (!l.mnemonic.empty() && ('.' == l.mnemonic[0])))
+		{
+			continue;
+		}
+		if (!l.mnemonic.empty())
+		{
+			++instructions;
+			bytes += instruction_cost(l.mnemonic, l.operand).bytes;
+		}
+		if (l.label.empty())
+		{
+			l.removed = true;
+			continue;
+		}
+		l.text = l.label;
+		l.mnemonic.clear();
+		l.operand.clear();
+	}
+	std::cout << std::endl << "*** DEAD CODE ELIMINATION ***" << std::endl;
+	std::cout << "Removed " << instructions << " unreachable instructions, about " << bytes << " bytes" << std::endl;
+}
+
+bool optimizer::is_number(const std::string& s, int& value)
+{
+	const auto hexadecimal = !s.empty() && ('$' == s[0]);
+	const auto digits = s.substr(hexadecimal ? 1 : 0);
+	if (digits.empty() || (digits.find_first_not_of(hexadecimal ? "0123456789abcdefABCDEF" : "0123456789") != std::string::npos))
+	{
+		return false;
+	}
+	value = std::stoi(digits, nullptr, hexadecimal ? 16 : 10);
+	return true;
+}
+
+// Absolute addressing is assumed for memory operands,
+// so the figures are an estimate
+optimizer::cost optimizer::instruction_cost(const std::string& mnemonic, const std::string& operand)
+{
+	if ("mva" == mnemonic || "mwa" == mnemonic)
+	{
+		std::istringstream s(operand);
+		std::string source;
+		std::string destination;
+		s >> source >> destination;
+		const auto load = instruction_cost("lda", source);
+		const auto store = instruction_cost("sta", destination);
+		const auto times = ("mwa" == mnemonic) ? 2 : 1;
+		return { times * (load.bytes + store.bytes), times * (load.cycles + store.cycles) };
+	}
+	if ("jsr" == mnemonic)
+	{
+		return { 3, 6 };
+	}
+	if ("jmp" == mnemonic)
+	{
+		return { 3, 3 };
+	}
+	if ("rts" == mnemonic)
+	{
+		return { 1, 6 };
+	}
+	if (is_jump(mnemonic))
+	{
+		return { 2, 3 };
+	}
+	if (operand.empty())
+	{
+		return { 1, 2 };
+	}
+	if ('#' == operand[0])
+	{
+		return { 2, 2 };
+	}
+	if ('(' == operand[0])
+	{
+		return { 2, 5 };
+	}
+	return { 3, 4 };
+}
+
+// Bound text may itself look like a placeholder (hex addresses), so a single pass
+std::string optimizer::substitute(const std::string& text, const std::map<std::string, std::string>& bindings)
+{
+	std::string result;
+	for (std::size_t i = 0; i < text.size();)
+	{
+		const auto end = std::min(text.find_first_not_of("0123456789", i + 1), text.size());
+		const auto bound = ('$' == text[i]) ? bindings.find(text.substr(i, end - i)) : bindings.end();
+		if (bound == bindings.end())
+		{
+			result += text[i++];
+			continue;
+		}
+		result += bound->second;
+		i = end;
+	}
+	return result;
+}
+
+void optimizer::index_symbols()
+{
+	symbols.clear();
+	int value;
+	for (const auto& l : lines)
+	{
+		if (!l.label.empty() && ("equ" == l.mnemonic) && is_number(l.operand, value))
+		{
+			symbols[l.label] = value;
+		}
+	}
+}
+
+bool optimizer::is_volatile(const std::string& operand) const
+{
+	if (operand.empty() || ('#' == operand[0]))
+	{
+		return false;
+	}
+	const auto start = ('(' == operand[0]) ? 1 : 0;
+	const auto address = operand.substr(start, operand.find_first_of("+-,) ", start) - start);
+	int value;
+	if (!is_number(address, value))
+	{
+		const auto it = symbols.find(address);
+		if (it == symbols.end())
+		{
+			return false;
+		}
+		value = it->second;
+	}
+	return (value >= IO_START) && (value <= IO_END);
+}
+
+// Instructions starting at the given one, with no label in between
+std::vector<std::size_t> optimizer::window(std::size_t index, std::size_t size) const
+{
+	std::vector<std::size_t> result = { index };
+	for (auto i = index + 1; (i < lines.size()) && (result.size() < size); ++i)
+	{
+		const auto& l = lines[i];
+		if (l.removed || "equ" == l.mnemonic || (l.mnemonic.empty() && l.label.empty()))
+		{
+			continue;
+		}
+		if (!l.label.empty())
+		{
+			break;
+		}
+		result.push_back(i);
+	}
+	return result;
+}
+
+// Placeholder is "$" followed by digits. Unbound one takes
+// the shortest text for which the rest still matches.
+bool optimizer::match_operand(const std::string& pattern, const std::string& text, std::map<std::string, std::string>& bindings)
+{
+	if (pattern.empty())
+	{
+		return text.empty();
+	}
+	if (('$' != pattern[0]) || (pattern.size() < 2) || !std::isdigit(static_cast<unsigned char>(pattern[1])))
+	{
+		return !text.empty() && (pattern[0] == text[0]) && match_operand(pattern.substr(1), text.substr(1), bindings);
+	}
+	const auto end = std::min(pattern.find_first_not_of("0123456789", 1), pattern.size());
+	const auto name = pattern.substr(0, end);
+	const auto rest = pattern.substr(end);
+	const auto bound = bindings.find(name);
+	if (bound != bindings.end())
+	{
+		return (0 == text.compare(0, bound->second.size(), bound->second)) && match_operand(rest, text.substr(bound->second.size()), bindings);
+	}
+	for (std::size_t length = 1; length <= text.size(); ++length)
+	{
+		auto attempt = bindings;
+		attempt[name] = text.substr(0, length);
+		if (match_operand(rest, text.substr(length), attempt))
+		{
+			bindings = attempt;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool optimizer::match(const std::vector<std::size_t>& w, const peephole_rule& rule, std::map<std::string, std::string>& bindings) const
+{
+	for (std::size_t i = 0; i < w.size(); ++i)
+	{
+		const auto& l = lines[w[i]];
+		if ((rule.pattern[i].substr(0, rule.pattern[i].find(' ')) != l.mnemonic) || is_volatile(l.operand))
+		{
+			return false;
+		}
+	}
+	for (std::size_t i = 0; i < w.size(); ++i)
+	{
+		const auto& p = rule.pattern[i];
+		const auto separator = p.find(' ');
+		if (!match_operand((separator == std::string::npos) ? "" : p.substr(separator + 1), lines[w[i]].operand, bindings))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Lines past the replacement are dropped, keeping only a label
+optimizer::cost optimizer::apply(const std::vector<std::size_t>& w, const peephole_rule& rule, const std::map<std::string, std::string>& bindings)
+{
+	cost saved = { 0, 0 };
+	for (std::size_t i = 0; i < w.size(); ++i)
+	{
+		auto& l = lines[w[i]];
+		const auto before = instruction_cost(l.mnemonic, l.operand);
+		saved.bytes += before.bytes;
+		saved.cycles += before.cycles;
+		if (i >= rule.replacement.size())
+		{
+			if (l.label.empty())
+			{
+				l.removed = true;
+			}
+			else
+			{
+				l.text = l.label;
+				l.mnemonic.clear();
+				l.operand.clear();
+			}
+			continue;
+		}
+		const auto replacement = substitute(rule.replacement[i], bindings);
+		const auto separator = replacement.find(' ');
+		set_instruction(l, replacement.substr(0, separator), (separator == std::string::npos) ? "" : replacement.substr(separator + 1));
+		const auto after = instruction_cost(l.mnemonic, l.operand);
+		saved.bytes -= after.bytes;
+		saved.cycles -= after.cycles;
+	}
+	return saved;
+}
+
+void optimizer::add_peephole_rule(const peephole_rule& rule)
+{
+	if (rule.replacement.size() > rule.pattern.size())
+	{
+		throw std::invalid_argument("peephole rule '" + rule.name + "' replacement longer than its pattern");
+	}
+	peephole_rules.push_back(rule);
+}
+
+// Selection is "all", "none" or a comma separated list of rule names.
+// Rules are applied over a sliding window until none of them matches.
+void optimizer::peephole(const std::string& selection)
+{
+	if ("none" == selection)
+	{
+		return;
+	}
+	std::vector<peephole_rule> selected;
+	if ("all" == selection)
+	{
+		selected = peephole_rules;
+	}
+	else
+	{
+		std::istringstream s(selection);
+		std::string name;
+		while (std::getline(s, name, ','))
+		{
+			const auto count = selected.size();
+			std::copy_if(peephole_rules.begin(), peephole_rules.end(), std::back_inserter(selected), [&](const peephole_rule& r) { return r.name == name; });
+			if (count == selected.size())
+			{
+				throw std::invalid_argument("unknown peephole rule '" + name + '\'');
+			}
+		}
+	}
+
+	struct statistics
+	{
+		int applied;
+		cost saved;
+	};
+	std::vector<std::string> names;
+	std::map<std::string, statistics> report;
+	for (const auto& r : selected)
+	{
+		if (report.emplace(r.name, statistics{ 0, { 0, 0 } }).second)
+		{
+			names.push_back(r.name);
+		}
+	}
+
+	index_symbols();
+	for (bool changed = true; changed;)
+	{
+		changed = false;
+		for (std::size_t i = 0; i < lines.size(); ++i)
+		{
+			for (const auto& r : selected)
+			{
+				if (lines[i].removed || lines[i].mnemonic.empty())
+				{
+					break;
+				}
+				auto w = window(i, r.pattern.size() + (r.followed_by.empty() ? 0 : 1));
+				std::map<std::string, std::string> bindings;
+				if (!r.followed_by.empty())
+				{
+					if ((w.size() <= r.pattern.size()) || !r.followed_by.count(lines[w.back()].mnemonic))
+					{
+						continue;
+					}
+					w.pop_back();
+				}
+				if ((w.size() != r.pattern.size()) || !match(w, r, bindings))
+				{
+					continue;
+				}
+				const auto saved = apply(w, r, bindings);
+				auto& entry = report[r.name];
+				++entry.applied;
+				entry.saved.bytes += saved.bytes;
+				entry.saved.cycles += saved.cycles;
+				changed = true;
+			}
+		}
+	}
+
+	cost total = { 0, 0 };
+	std::cout << std::endl << "*** PEEPHOLE OPTIMIZATION ***" << std::endl;
+	for (const auto& n : names)
+	{
+		const auto& entry = report[n];
+		std::cout << n << ": applied " << entry.applied << " times, saved " << entry.saved.bytes << " bytes, " << entry.saved.cycles << " cycles" << std::endl;
+		total.bytes += entry.saved.bytes;
+		total.cycles += entry.saved.cycles;
+	}
+	std::cout << "Total: saved " << total.bytes << " bytes, " << total.cycles << " cycles" << std::endl;
+}
+
+void optimizer::write(std::ostream& out) const
+{
+	for (const auto& l : lines)
+	{
+		if (!l.removed)
+		{
+			out << l.text << '\n';
+		}
+	}
+}
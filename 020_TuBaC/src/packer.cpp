@@ -0,0 +1,264 @@
+/*
+ *
+ * Turbo Basic Compiler by mgr_inz_rafal.
+ *
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <rchabowski@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ *														// mgr inz. Rafal
+ * ----------------------------------------------------------------------------
+ */
+
+#include "packer.h"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+
+// Splits the executable into segments. Header $FFFF may
+// precede any of them and there are no gaps in between.
+packer::packer(const std::string& executable, synthesizer& _synth, char endline):
+	raw_size(executable.size()), E_(endline), synth(_synth)
+{
+	const auto word = [&executable](std::size_t i) {
+		return static_cast<unsigned char>(executable[i]) | (static_cast<unsigned char>(executable[i + 1]) << 8);
+	};
+	std::size_t i = 0;
+	while (i < executable.size())
+	{
+		if ((i + 2 <= executable.size()) && (0xFFFF == word(i)))
+		{
+			i += 2;
+			continue;
+		}
+		if (i + 4 > executable.size())
+		{
+			throw std::invalid_argument("truncated segment header in the executable");
+		}
+		const int start = word(i);
+		const int end = word(i + 2);
+		i += 4;
+		if ((end < start) || (i + (end - start + 1) > executable.size()))
+		{
+			throw std::invalid_argument("invalid segment in the executable");
+		}
+		segment s{ start, std::vector<unsigned char>(executable.begin() + i, executable.begin() + i + (end - start + 1)) };
+		i += s.data.size();
+		const bool vectors = (start <= VECTORS_END) && (end >= VECTORS_START);
+		((vectors || (start < 0x100)) ? kept : packed).push_back(s);
+	}
+	if (packed.empty())
+	{
+		throw std::invalid_argument("nothing to pack in the executable");
+	}
+}
+
+// Greedy parsing, the longest match among the recent
+// occurrences of the next three bytes is taken
+std::vector<unsigned char> packer::compress(const std::vector<unsigned char>& data) const
+{
+	std::vector<unsigned char> result;
+	std::vector<unsigned char> literals;
+	std::map<int, std::vector<std::size_t>> occurrences;
+
+	const auto flush_literals = [&]() {
+		for (std::size_t i = 0; i < literals.size(); i += MAXIMUM_LITERALS)
+		{
+			const auto count = std::min(MAXIMUM_LITERALS, literals.size() - i);
+			result.push_back(static_cast<unsigned char>(count));
+			result.insert(result.end(), literals.begin() + i, literals.begin() + i + count);
+		}
+		literals.clear();
+	};
+	const auto note = [&](std::size_t i) {
+		if (i + 3 <= data.size())
+		{
+			occurrences[(data[i] << 16) | (data[i + 1] << 8) | data[i + 2]].push_back(i);
+		}
+	};
+
+	std::size_t i = 0;
+	while (i < data.size())
+	{
+		std::size_t length = 0;
+		std::size_t offset = 0;
+		if (i + MINIMUM_MATCH <= data.size())
+		{
+			const auto it = occurrences.find((data[i] << 16) | (data[i + 1] << 8) | data[i + 2]);
+			if (it != occurrences.end())
+			{
+				const auto& candidates = it->second;
+				const auto limit = std::min(MAXIMUM_MATCH, data.size() - i);
+				for (auto c = candidates.rbegin(); (c != candidates.rend()) && (c - candidates.rbegin() < static_cast<std::ptrdiff_t>(MAXIMUM_CANDIDATES)); ++c)
+				{
+					if (i - *c > 0xFFFF)
+					{
+						break;
+					}
+					std::size_t l = 0;
+					while ((l < limit) && (data[*c + l] == data[i + l]))
+					{
+						++l;
+					}
+					if (l > length)
+					{
+						length = l;
+						offset = i - *c;
+					}
+				}
+			}
+		}
+		if (length < MINIMUM_MATCH)
+		{
+			literals.push_back(data[i]);
+			note(i++);
+			continue;
+		}
+		flush_literals();
+		result.push_back(static_cast<unsigned char>(0x80 | (length - MINIMUM_MATCH)));
+		result.push_back(static_cast<unsigned char>(offset & 0xFF));
+		result.push_back(static_cast<unsigned char>(offset >> 8));
+		for (std::size_t j = 0; j < length; ++j)
+		{
+			note(i++);
+		}
+	}
+	flush_literals();
+	result.push_back(0);
+	return result;
+}
+
+void packer::write() const
+{
+	int end = 0;
+	for (const auto& s : packed)
+	{
+		end = std::max(end, s.start + static_cast<int>(s.data.size()));
+	}
+
+	std::cout << std::endl << "*** PACKED EXECUTABLE ***" << std::endl;
+	synth.synth(false) << "; Packed executable" << E_;
+	synth.synth(false) << "INITAD equ $2E2" << E_;
+	synth.synth() << "org $" << std::hex << end << std::dec << E_;
+	synth_unpacker();
+
+	// Segment headers and the INITAD segment take 2+4+4+2 bytes
+	std::size_t size = 12;
+	synth.synth(false) << "UNPACK_DATA" << E_;
+	for (const auto& s : packed)
+	{
+		const auto bytes = compress(s.data);
+		std::cout << "Segment $" << std::hex << s.start << "-$" << s.start + s.data.size() - 1 << std::dec
+			<< ": " << s.data.size() << " -> " << bytes.size() << " bytes" << std::endl;
+		synth.synth() << "dta a($" << std::hex << s.start << std::dec << ')' << E_;
+		synth_bytes(bytes);
+		size += 2 + bytes.size();
+	}
+	synth.synth() << "dta a(0)" << E_;
+	size += 2;
+	synth.synth() << ".if * > $" << std::hex << MEMORY_TOP << std::dec << E_;
+	synth.synth() << ".error \"Packed executable does not fit in memory\"" << E_;
+	synth.synth() << ".endif" << E_;
+
+	synth.synth() << "org INITAD" << E_;
+	synth.synth() << "dta a(UNPACK)" << E_;
+	for (const auto& s : kept)
+	{
+		synth.synth() << "org $" << std::hex << s.start << std::dec << E_;
+		synth_bytes(s.data);
+		size += 4 + s.data.size();
+	}
+	std::cout << "Executable: " << raw_size << " bytes raw, " << size << " bytes packed plus the unpacker" << std::endl;
+}
+
+void packer::synth_bytes(const std::vector<unsigned char>& bytes) const
+{
+	const std::size_t PER_LINE = 16;
+	for (std::size_t i = 0; i < bytes.size(); i += PER_LINE)
+	{
+		synth.synth() << "dta ";
+		for (std::size_t j = i; j < std::min(i + PER_LINE, bytes.size()); ++j)
+		{
+			synth.synth(false) << ((j == i) ? "$" : ",$") << std::hex << static_cast<int>(bytes[j]) << std::dec;
+		}
+		synth.synth(false) << E_;
+	}
+}
+
+/*
+Unpacks all the segments. Runs while the executable is still being
+loaded, so it only uses the zero page left free for BASIC.
+*/
+void packer::synth_unpacker() const
+{
+	synth.synth(false) << "UNPACK_MINIMUM_MATCH equ " << MINIMUM_MATCH << E_;
+	synth.synth() << R"(
+UNPACK_SOURCE equ $80
+UNPACK_TARGET equ $82
+UNPACK_REFERENCE equ $84
+UNPACK
+	mwa #UNPACK_DATA UNPACK_SOURCE
+UNPACK_SEGMENT
+	jsr UNPACK_GET
+	sta UNPACK_TARGET
+	jsr UNPACK_GET
+	beq UNPACK_DONE
+	sta UNPACK_TARGET+1
+UNPACK_TOKEN
+	jsr UNPACK_GET
+	beq UNPACK_SEGMENT
+	bmi UNPACK_MATCH
+	tax
+UNPACK_LITERAL
+	jsr UNPACK_GET
+	ldy #0
+	sta (UNPACK_TARGET),y
+	inw UNPACK_TARGET
+	dex
+	bne UNPACK_LITERAL
+	jmp UNPACK_TOKEN
+UNPACK_MATCH
+	and #$7F
+	clc
+	adc #UNPACK_MINIMUM_MATCH
+	tax
+	jsr UNPACK_GET
+	sta UNPACK_REFERENCE
+	jsr UNPACK_GET
+	sta UNPACK_REFERENCE+1
+	sec
+	lda UNPACK_TARGET
+	sbc UNPACK_REFERENCE
+	sta UNPACK_REFERENCE
+	lda UNPACK_TARGET+1
+	sbc UNPACK_REFERENCE+1
+	sta UNPACK_REFERENCE+1
+	ldy #0
+UNPACK_COPY
+	lda (UNPACK_REFERENCE),y
+	sta (UNPACK_TARGET),y
+	iny
+	dex
+	bne UNPACK_COPY
+	tya
+	clc
+	adc UNPACK_TARGET
+	sta UNPACK_TARGET
+	bcc UNPACK_TOKEN
+	inc UNPACK_TARGET+1
+	jmp UNPACK_TOKEN
+UNPACK_DONE
+	rts
+
+; Next byte of the packed data is left in A, flags are set by it
+UNPACK_GET
+	ldy #0
+	lda (UNPACK_SOURCE),y
+	inw UNPACK_SOURCE
+	cmp #0
+	rts
+)";
+}
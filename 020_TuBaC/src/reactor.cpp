@@ -17,247 +17,387 @@
 
 reactor::reactor(generator& g) : _g(g) {}
 
+// Every access to the generator passes through here, so that
+// comparison and literals held back reach the expression stack
+// before anything else is emitted
+generator& reactor::gen()
+{
+	if (short_circuit_pending)
+	{
+		generator::COMPARISON c;
+		if (take_comparison(c))
+		{
+			_g.short_circuit_value(c);
+		}
+		else
+		{
+			short_circuit_pending = false;
+			_g.short_circuit_value();
+		}
+	}
+	if (comparison_pending)
+	{
+		comparison_pending = false;
+		_g.compare(pending_comparison);
+	}
+	for (const auto& i : folder.take_pending())
+	{
+		_g.put_integer_on_stack(std::to_string(i));
+	}
+	return _g;
+}
+
+bool reactor::fold(constant_folder::OPERATION operation)
+{
+	if (folder.fold(operation))
+	{
+		std::cout << "FOLDED" << std::endl;
+		return true;
+	}
+	return false;
+}
+
+void reactor::defer_comparison(const generator::COMPARISON& c)
+{
+	gen();
+	comparison_pending = true;
+	pending_comparison = c;
+}
+
+// Comparison can be fused with the branch only when
+// its result is the topmost value on the stack
+bool reactor::take_comparison(generator::COMPARISON& c)
+{
+	if (!comparison_pending || folder.has_pending())
+	{
+		return false;
+	}
+	comparison_pending = false;
+	short_circuit_pending = false;
+	c = pending_comparison;
+	return true;
+}
+
+// Result of the expression is about to be branched on,
+// which settles the pending AND or OR as well
+generator& reactor::condition()
+{
+	short_circuit_pending = false;
+	return gen();
+}
+
+void reactor::start_logical_operation(bool is_and)
+{
+	const bool skipping = in_condition && !folder.has_pending();
+	short_circuits.push(skipping);
+	if (!skipping)
+	{
+		return;
+	}
+	generator::COMPARISON c;
+	if (take_comparison(c))
+	{
+		_g.short_circuit(is_and, c);
+		return;
+	}
+	condition().short_circuit(is_and);
+}
+
+// Comparison or another AND/OR in the right operand stays pending,
+// so that it can be fused with whatever branches on the result
+bool reactor::finish_logical_operation()
+{
+	const bool skipping = short_circuits.top();
+	short_circuits.pop();
+	if (!skipping)
+	{
+		return false;
+	}
+	if (folder.has_pending())
+	{
+		gen();
+	}
+	_g.close_short_circuit();
+	short_circuit_pending = true;
+	return true;
+}
+
 void reactor::got_line_number(const int& i)
 {
 	std::cout << std::endl << "*** LINE " << i << " ***" << std::endl;
 	ctx.array_assignment_side_reset();
-	_g.new_line(i);
+	gen().new_line(i);
 }
 
-void reactor::got_asterisk() const
+void reactor::got_asterisk()
 {
 	std::cout << "MUL" << std::endl;
-	_g.pop_to("FR1");
-	_g.pop_to("FR0");
-	_g.multiplication();
-	_g.push_from("FR0");
+	if (fold(constant_folder::OPERATION::MULTIPLICATION))
+	{
+		return;
+	}
+	gen().multiplication();
 }
 
-void reactor::got_slash() const
+void reactor::got_slash()
 {
 	std::cout << "DIV" << std::endl;
-	_g.pop_to("FR1");
-	_g.pop_to("FR0");
-	_g.division();
-	_g.push_from("FR0");
+	if (fold(constant_folder::OPERATION::DIVISION))
+	{
+		return;
+	}
+	gen().division();
+}
+
+void reactor::got_logical_and_left()
+{
+	start_logical_operation(true);
 }
 
-void reactor::got_logical_and() const
+void reactor::got_logical_or_left()
+{
+	start_logical_operation(false);
+}
+
+void reactor::got_logical_and()
 {
 	std::cout << "LOGICAL AND" << std::endl;
-	_g.pop_to("FR1");
-	_g.pop_to("FR0");
-	_g.logical_and();
-	_g.push_from("FR0");
+	if (finish_logical_operation())
+	{
+		return;
+	}
+	if (fold(constant_folder::OPERATION::LOGICAL_AND))
+	{
+		return;
+	}
+	gen().pop_to("FR1");
+	gen().pop_to("FR0");
+	gen().logical_and();
+	gen().push_from("FR0");
 }
 
-void reactor::got_logical_or() const
+void reactor::got_logical_or()
 {
 	std::cout << "LOGICAL OR" << std::endl;
-	_g.pop_to("FR1");
-	_g.pop_to("FR0");
-	_g.logical_or();
-	_g.push_from("FR0");
+	if (finish_logical_operation())
+	{
+		return;
+	}
+	if (fold(constant_folder::OPERATION::LOGICAL_OR))
+	{
+		return;
+	}
+	gen().pop_to("FR1");
+	gen().pop_to("FR0");
+	gen().logical_or();
+	gen().push_from("FR0");
 }
 
-void reactor::got_binary_xor() const
+void reactor::got_binary_xor()
 {
 	std::cout << "BINARY XOR" << std::endl;
-	_g.pop_to("FR1");
-	_g.pop_to("FR0");
-	_g.binary_xor();
-	_g.push_from("FR0");
+	if (fold(constant_folder::OPERATION::BINARY_XOR))
+	{
+		return;
+	}
+	gen().binary_xor();
 }
 
-void reactor::got_binary_and() const
+void reactor::got_binary_and()
 {
 	std::cout << "BINARY AND" << std::endl;
-	_g.pop_to("FR1");
-	_g.pop_to("FR0");
-	_g.binary_and();
-	_g.push_from("FR0");
+	if (fold(constant_folder::OPERATION::BINARY_AND))
+	{
+		return;
+	}
+	gen().binary_and();
 }
 
-void reactor::got_binary_or() const
+void reactor::got_binary_or()
 {
 	std::cout << "BINARY AND" << std::endl;
-	_g.pop_to("FR1");
-	_g.pop_to("FR0");
-	_g.binary_or();
-	_g.push_from("FR0");
+	if (fold(constant_folder::OPERATION::BINARY_OR))
+	{
+		return;
+	}
+	gen().binary_or();
 }
 
-void reactor::got_plus() const
+void reactor::got_plus()
 {
 	std::cout << "ADD" << std::endl;
-	_g.pop_to("FR1");
-	_g.pop_to("FR0");
-	_g.addition();
-	_g.push_from("FR0");
+	if (fold(constant_folder::OPERATION::ADDITION))
+	{
+		return;
+	}
+	gen().addition();
 }
 
-void reactor::got_minus() const
+void reactor::got_minus()
 {
 	std::cout << "SUB" << std::endl;
-	_g.pop_to("FR1");
-	_g.pop_to("FR0");
-	_g.subtraction();
-	_g.push_from("FR0");
+	if (fold(constant_folder::OPERATION::SUBTRACTION))
+	{
+		return;
+	}
+	gen().subtraction();
 }
 
-void reactor::got_compare_equal() const
+void reactor::got_compare_equal()
 {
 	std::cout << "EQ" << std::endl;
-	_g.pop_to("FR1");
-	_g.pop_to("FR0");
-	_g.compare_equal();
-	_g.push_from("FR0");
+	if (fold(constant_folder::OPERATION::COMPARE_EQUAL))
+	{
+		return;
+	}
+	defer_comparison(generator::COMPARISON::EQUAL);
 }
 
-void reactor::got_compare_not_equal() const
+void reactor::got_compare_not_equal()
 {
 	std::cout << "NEQ" << std::endl;
-	_g.pop_to("FR1");
-	_g.pop_to("FR0");
-	_g.compare_equal();
-	_g.FR0_boolean_invert();
-	_g.push_from("FR0");
+	if (fold(constant_folder::OPERATION::COMPARE_NOT_EQUAL))
+	{
+		return;
+	}
+	defer_comparison(generator::COMPARISON::NOT_EQUAL);
 }
 
-void reactor::got_compare_less() const
+void reactor::got_compare_less()
 {
 	std::cout << "LESS" << std::endl;
-	_g.pop_to("FR1");
-	_g.pop_to("FR0");
-	_g.compare_less();
-	_g.push_from("FR0");
+	if (fold(constant_folder::OPERATION::COMPARE_LESS))
+	{
+		return;
+	}
+	defer_comparison(generator::COMPARISON::LESS);
 }
 
-void reactor::got_compare_greater_equal() const
+void reactor::got_compare_greater_equal()
 {
 	std::cout << "GREATER EQUAL" << std::endl;
-	_g.pop_to("FR1");
-	_g.pop_to("FR0");
-	_g.compare_less();
-	_g.FR0_boolean_invert();
-	_g.push_from("FR0");
+	if (fold(constant_folder::OPERATION::COMPARE_GREATER_EQUAL))
+	{
+		return;
+	}
+	defer_comparison(generator::COMPARISON::GREATER_EQUAL);
 }
 
-void reactor::got_compare_greater() const
+void reactor::got_compare_greater()
 {
 	std::cout << "GREATER" << std::endl;
-	_g.pop_to("FR1");
-	_g.pop_to("FR0");
-	_g.compare_greater();
-	_g.push_from("FR0");
+	if (fold(constant_folder::OPERATION::COMPARE_GREATER))
+	{
+		return;
+	}
+	defer_comparison(generator::COMPARISON::GREATER);
 }
 
-void reactor::got_compare_less_equal() const
+void reactor::got_compare_less_equal()
 {
 	std::cout << "LESS EQUAL" << std::endl;
-	_g.pop_to("FR1");
-	_g.pop_to("FR0");
-	_g.compare_greater();
-	_g.FR0_boolean_invert();
-	_g.push_from("FR0");
+	if (fold(constant_folder::OPERATION::COMPARE_LESS_EQUAL))
+	{
+		return;
+	}
+	defer_comparison(generator::COMPARISON::LESS_EQUAL);
 }
 
-void reactor::got_integer(int i) const
+void reactor::got_integer(int i)
 {
 	std::cout << "INTEGER: " << i << std::endl;
 
-	_g.new_integer(std::to_string(i));
-	_g.put_integer_on_stack(std::to_string(i));
+	folder.push(i);
 }
 
 void reactor::got_print_expression()
 {
 	std::cout << "PRINT EXPRESSION" << std::endl;
-	_g.pop_to("FR0");
-	_g.FP_to_ASCII();
-	_g.print_LBUFF();
+	gen().pop_to("FR0");
+	gen().FP_to_ASCII();
+	gen().print_LBUFF();
 	last_printed_token_was_separator = false;
 }
 
-void reactor::got_goto_integer(const int& i) const
+void reactor::got_goto_integer(const int& i)
 {
 	std::cout << "GOTO INTEGER " << i << std::endl;
-	_g.goto_line(i);
+	gen().goto_line(i);
 }
 
-void reactor::got_gosub_integer(const int& i) const
+void reactor::got_gosub_integer(const int& i)
 {
 	std::cout << "GOSUB INTEGER " << i << std::endl;
-	_g.gosub(i);
+	gen().gosub(i);
 }
 
 void reactor::got_variable_to_assign(const std::string& s)
 {
 	std::cout << "ASSIGN TO VARIABLE " << s << std::endl;
 	variable_recently_assigned_to = s;
-	_g.new_variable(s);
-	_g.pop_to_variable(s);
+	gen().new_variable(s);
+	gen().pop_to_variable(s);
 }
 
-void reactor::got_variable_to_retrieve(const std::string& s) const
+void reactor::got_variable_to_retrieve(const std::string& s)
 {
 	std::cout << "RETRIEVE FROM VARIABLE " << s << std::endl;
-	_g.push_from_variable(s);
+	gen().push_from_variable(s);
 }
 
-void reactor::got_sound() const
+void reactor::got_sound()
 {
 	std::cout << "SOUND" << std::endl;
-	_g.sound();
+	gen().sound();
 }
 
-void reactor::got_poke() const
+void reactor::got_poke()
 {
 	std::cout << "POKE" << std::endl;
-	_g.poke();
+	gen().poke();
 }
 
-void reactor::got_dpoke() const
+void reactor::got_dpoke()
 {
 	std::cout << "DPOKE" << std::endl;
-	_g.dpoke();
+	gen().dpoke();
 }
 
-void reactor::got_peek() const
+void reactor::got_peek()
 {
 	std::cout << "PEEK" << std::endl;
-	_g.peek();
+	gen().peek();
 }
 
-void reactor::got_dpeek() const
+void reactor::got_dpeek()
 {
 	std::cout << "DPEEK" << std::endl;
-	_g.dpeek();
+	gen().dpeek();
 }
 
-void reactor::got_stick() const
+void reactor::got_stick()
 {
 	std::cout << "STICK" << std::endl;
-	_g.stick();
+	gen().stick();
 }
 
-void reactor::got_strig() const
+void reactor::got_strig()
 {
 	std::cout << "STRIG" << std::endl;
-	_g.strig();
+	gen().strig();
 }
 
 void reactor::got_for()
 {
 	std::cout << "FOR" << std::endl;
 	recent_for_had_step = false;
-	_g.for_loop_counter(variable_recently_assigned_to);
+	gen().for_loop_counter(variable_recently_assigned_to);
 }
 
-void reactor::got_to() const
+void reactor::got_to()
 {
 	std::cout << "TO" << std::endl;
-	_g.for_loop_condition();
+	gen().for_loop_condition();
 }
 
 void reactor::got_step()
@@ -266,117 +406,144 @@ void reactor::got_step()
 	recent_for_had_step = true;
 }
 
-void reactor::got_after_for() const
+void reactor::got_after_for()
 {
 	std::cout << "AFTER FOR" << std::endl;
-	_g.for_step(!recent_for_had_step);
+	gen().for_step(!recent_for_had_step);
 }
 
-void reactor::got_next() const
+void reactor::got_next()
 {
 	std::cout << "NEXT" << std::endl;
-	_g.next();
+	gen().next();
+}
+
+void reactor::got_condition()
+{
+	in_condition = true;
 }
 
-void reactor::got_if() const
+void reactor::got_if()
 {
 	std::cout << "IF" << std::endl;
-	_g.skip_if_on_false();
+	in_condition = false;
+	generator::COMPARISON c;
+	if (take_comparison(c))
+	{
+		_g.skip_if_on_false(c);
+		return;
+	}
+	condition().skip_if_on_false();
 }
 
-void reactor::got_then() const
+void reactor::got_then()
 {
 	std::cout << "THEN" << std::endl;
-	_g.after_if();
+	gen().after_if();
 }
 
-void reactor::got_else() const
+void reactor::got_else()
 {
 	std::cout << "ELSE" << std::endl;
-	_g.inside_if();
+	gen().inside_if();
 }
 
-void reactor::got_endif() const
+void reactor::got_endif()
 {
 	std::cout << "ENDIF" << std::endl;
-	_g.after_if();
+	gen().after_if();
 }
 
-void reactor::got_while() const
+void reactor::got_while()
 {
 	std::cout << "WHILE" << std::endl;
-	_g.while_();
+	gen().while_();
+	in_condition = true;
 }
 
-void reactor::got_while_condition() const
+void reactor::got_while_condition()
 {
 	std::cout << "WHILE CONDITION" << std::endl;
-	_g.while_condition();
+	in_condition = false;
+	generator::COMPARISON c;
+	if (take_comparison(c))
+	{
+		_g.while_condition(c);
+		return;
+	}
+	condition().while_condition();
 }
 
-void reactor::got_wend() const
+void reactor::got_wend()
 {
 	std::cout << "WEND" << std::endl;
-	_g.wend();
+	gen().wend();
 }
 
-void reactor::got_exit() const
+void reactor::got_exit()
 {
 	std::cout << "EXIT" << std::endl;
-	_g.exit();
+	gen().exit();
 }
 
-void reactor::got_repeat() const
+void reactor::got_repeat()
 {
 	std::cout << "REPEAT" << std::endl;
-	_g.repeat();
+	gen().repeat();
 }
 
-void reactor::got_until() const
+void reactor::got_until()
 {
 	std::cout << "UNTIL" << std::endl;
-	_g.until();
+	in_condition = false;
+	generator::COMPARISON c;
+	if (take_comparison(c))
+	{
+		_g.until(c);
+		return;
+	}
+	condition().until();
 }
 
-void reactor::got_do() const
+void reactor::got_do()
 {
 	std::cout << "DO" << std::endl;
-	_g.do_();
+	gen().do_();
 }
 
-void reactor::got_loop() const
+void reactor::got_loop()
 {
 	std::cout << "LOOP" << std::endl;
-	_g.loop();
+	gen().loop();
 }
 
-void reactor::got_return() const
+void reactor::got_return()
 {
 	std::cout << "RETURN" << std::endl;
-	_g.return_();
+	gen().return_();
 }
 
-void reactor::got_exec(const std::string& s) const
+void reactor::got_exec(const std::string& s)
 {
 	std::cout << "EXEC " << s << std::endl;
-	_g.gosub(s);
+	gen().gosub(s);
 }
 
-void reactor::got_proc(const std::string& s) const
+void reactor::got_proc(const std::string& s)
 {
 	std::cout << "PROC " << s << std::endl;
-	_g.proc(s);
+	gen().proc(s);
 }
 
-void reactor::got_endproc() const
+void reactor::got_endproc()
 {
 	std::cout << "ENDPROC" << std::endl;
-	_g.return_();
+	gen().endproc();
 }
 
-void reactor::got_end() const
+void reactor::got_end()
 {
-	_g.end();
+	gen().end();
 }
 
 void reactor::got_separator_semicolon()
@@ -388,23 +555,23 @@ void reactor::got_separator_semicolon()
 void reactor::got_separator_comma()
 {
 	std::cout << "SEPARATOR COMMA" << std::endl;
-	_g.print_comma();
+	gen().print_comma();
 	last_printed_token_was_separator = true;
 }
 
-void reactor::got_after_print() const
+void reactor::got_after_print()
 {
 	std::cout << "PRINT NEW LINE: " << !last_printed_token_was_separator << std::endl;
 	if (!last_printed_token_was_separator)
 	{
-		_g.print_newline();
+		gen().print_newline();
 	}
 }
 
 void reactor::got_print()
 {
 	std::cout << "PRINT" << std::endl;
-	_g.init_print();
+	gen().init_print();
 	last_printed_token_was_separator = false;
 }
 
@@ -435,42 +602,21 @@ void reactor::got_integer_array_size_2(int i)
 void reactor::got_array_declaration_finished()
 {
 	std::cout << "INTEGER ARRAY DECLARATION FINISHED" << std::endl;
-	_g.init_integer_array(ctx.array_get());
+	gen().init_integer_array(ctx.array_get());
 }
 
 void reactor::got_integer_array_to_retrieve()
 {
 	std::cout << "RETRIEVE FROM ARRAY " << ctx.array_get().get_name() << std::endl;
 
-	// TODO: Rename "assigning_to..." since it is also used in retrieval
-	if(ctx.array_get().is_two_dimensional())
-	{
-		_g.pop_to("FR0");
-	}
-	else
-	{
-		_g.put_zero_in_FR0();
-	}
-	_g.pop_to("FR1");
-	_g.retrieve_from_array(ctx.array_get().get_name());
-	_g.push_from("FR0");
+	gen().retrieve_from_array(ctx.array_get());
 }
 
 void reactor::got_integer_array_to_assign()
 {
 	std::cout << "ASSIGN TO ARRAY " << ctx.array_get(context::ARRAY_ASSIGNMENT_SIDE::LEFT).get_name() << std::endl;
 
-	_g.pop_to("ARRAY_ASSIGNMENT_TMP_VALUE");
-	if(ctx.array_get(context::ARRAY_ASSIGNMENT_SIDE::LEFT).is_two_dimensional())
-	{
-		_g.pop_to("FR0");
-	}
-	else
-	{
-		_g.put_zero_in_FR0();
-	}
-	_g.pop_to("FR1");
-	_g.assign_to_array(ctx.array_get(context::ARRAY_ASSIGNMENT_SIDE::LEFT).get_name());
+	gen().assign_to_array(ctx.array_get(context::ARRAY_ASSIGNMENT_SIDE::LEFT));
 }
 
 void reactor::got_integer_array_first_dimension()
@@ -489,6 +635,7 @@ void reactor::got_command_separator()
 {
 	std::cout << "COMMAND SEPARATOR" << std::endl;
 	ctx.array_assignment_side_reset();
+	gen().new_statement();
 }
 
 void reactor::got_execute_array_assignment()
@@ -497,17 +644,36 @@ void reactor::got_execute_array_assignment()
 	ctx.array_assignment_side_switch_to_right();
 }
 
-void reactor::got_random() const
+// Command starting with a parenthesis, like "IF (A>1)", is first taken
+// for an assignment to an array up to the missing "=". Whatever its index
+// left behind is dropped, the command parses the expression again.
+void reactor::got_abandoned_array_assignment()
+{
+	folder.take_pending();
+	comparison_pending = false;
+	_g.discard_operands();
+}
+
+void reactor::got_random()
 {
 	std::cout << "RANDOM" << std::endl;
-	_g.random();
-	_g.push_from("FR0");
+	gen().random();
+	gen().push_from("FR0");
 }
 
-void reactor::got_not() const
+void reactor::got_not()
 {
 	std::cout << "NOT" << std::endl;
-	_g.pop_to("FR0");
-	_g.FR0_boolean_invert();
-	_g.push_from("FR0");
+	if (fold(constant_folder::OPERATION::LOGICAL_NOT))
+	{
+		return;
+	}
+	if (comparison_pending && !folder.has_pending() && !short_circuit_pending)
+	{
+		pending_comparison = generator::negate(pending_comparison);
+		return;
+	}
+	gen().pop_to("FR0");
+	gen().FR0_boolean_invert();
+	gen().push_from("FR0");
 }
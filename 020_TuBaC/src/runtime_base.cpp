@@ -11,6 +11,9 @@
  * ----------------------------------------------------------------------------
  */
 
+#include <algorithm>
+#include <iostream>
+
 #include "runtime_base.h"
 #include "config.h"
 
@@ -24,51 +27,118 @@ const std::string& runtime_base::token(const token_provider::TOKENS& token) cons
 	return cfg.get_token_provider().get(token);
 }
 
-// Synthesises various common functions
+// Synthesises common functions referenced by the program
 void runtime_base::synth_implementation() const
 {
-	synth_COMPARE_NUMBER();
-	synth_COMPARE_FR0_FR1();
-	synth_LOGICAL_AND();
-	synth_LOGICAL_OR();
-	synth_BINARY_XOR();
-	synth_BINARY_AND();
-	synth_BINARY_OR();
-	synth_IsXY00();
-	synth_TRUE_FALSE();
-	synth_FR0_boolean_invert();
-	synth_PUT_ZERO_IN_FR0();
-	synth_PUT_RANDOM_IN_FR0();
-	synth_Is_FR0_true();
-	synth_INIT_ARRAY_OFFSET();
-	synth_CALCULATE_ARRAY_ROW_SIZE_IN_BYTES();
+	using routine = void (runtime_base::*)() const;
+	const std::vector<std::pair<std::string, routine>> routines = {
+		{ "COMPARE_NUMBER",						&runtime_base::synth_COMPARE_NUMBER },
+		{ "COMPARE_FR0_FR1",					&runtime_base::synth_COMPARE_FR0_FR1 },
+		{ "LOGICAL_AND",						&runtime_base::synth_LOGICAL_AND },
+		{ "LOGICAL_OR",							&runtime_base::synth_LOGICAL_OR },
+		{ "BINARY_XOR",							&runtime_base::synth_BINARY_XOR },
+		{ "BINARY_AND",							&runtime_base::synth_BINARY_AND },
+		{ "BINARY_OR",							&runtime_base::synth_BINARY_OR },
+		{ "TRUE_FALSE",							&runtime_base::synth_TRUE_FALSE },
+		{ "FR0_boolean_invert",					&runtime_base::synth_FR0_boolean_invert },
+		{ "PUT_ZERO_IN_FR0",					&runtime_base::synth_PUT_ZERO_IN_FR0 },
+		{ "PUT_RANDOM_IN_FR0",					&runtime_base::synth_PUT_RANDOM_IN_FR0 },
+		{ "Is_FR0_true",						&runtime_base::synth_Is_FR0_true },
+		{ "BADD",								&runtime_base::synth_BADD },
+		{ "BSUB",								&runtime_base::synth_BSUB },
+		{ "BMUL",								&runtime_base::synth_BMUL },
+		{ "BDIV",								&runtime_base::synth_BDIV },
+		{ "FASC",								&runtime_base::synth_FASC },
+		{ "PUTCHAR",							&runtime_base::synth_PUTCHAR },
+		{ "PUTNEWLINE",							&runtime_base::synth_PUTNEWLINE },
+		{ "PUTSPACE",							&runtime_base::synth_PUTSPACE },
+		{ "PUTSTRING",							&runtime_base::synth_PUTSTRING },
+		{ "PUTCOMMA",							&runtime_base::synth_PUTCOMMA },
+		{ "SOUND",								&runtime_base::synth_SOUND },
+		{ "POKEY_INIT",							&runtime_base::synth_POKEY_INIT },
+		{ "POKE",								&runtime_base::synth_POKE },
+		{ "DPOKE",								&runtime_base::synth_DPOKE },
+		{ "PEEK",								&runtime_base::synth_PEEK },
+		{ "DPEEK",								&runtime_base::synth_DPEEK },
+		{ "BLOCK_PARAMETERS",					&runtime_base::synth_BLOCK_PARAMETERS },
+		{ "BLOCK_FILL",							&runtime_base::synth_BLOCK_FILL },
+		{ "BLOCK_COPY",							&runtime_base::synth_BLOCK_COPY },
+		{ "STICK",								&runtime_base::synth_STICK },
+		{ "STRIG",								&runtime_base::synth_STRIG },
+		{ "FOR_NEXT",							&runtime_base::synth_FOR_NEXT }
+	};
+
 	synth_helpers();
+	for (const auto& r : routines)
+	{
+		if (is_used(r.first))
+		{
+			(this->*r.second)();
+		}
+	}
+	synth_own_functions();
+	synth_scratch_pool();
+}
 
-	synth_BADD();
-	synth_BSUB();
-	synth_BMUL();
-	synth_BDIV();
-	synth_FASC();
-	synth_PUTCHAR();
-	synth_PUTNEWLINE();
-	synth_PUTSPACE();
-	synth_PUTSTRING();
-	synth_PUTCOMMA();
-	synth_SOUND();
-	synth_POKEY_INIT();
-	synth_POP_TO();
-	synth_PEEK_TO();
-	synth_PUSH_FROM();
-	synth_INIT_PUSH_POP_POINTER();
-	synth_POKE();
-	synth_DPOKE();
-	synth_PEEK();
-	synth_DPEEK();
-	synth_STICK();
-	synth_STRIG();
-	synth_FAKE_POP();
+// Scratch cells of the used routines are placed at RUNTIME_SCRATCH
+void runtime_base::synth_scratch_pool() const
+{
+	int size = 0;
+	int separate = 0;
+	for (const auto& r : used_routines)
+	{
+		size = std::max(size, get_scratch_size(r));
+		separate += get_scratch_size(r);
+	}
+	if (0 == size)
+	{
+		return;
+	}
+	synth.synth(false) << "RUNTIME_SCRATCH" << E_;
+	synth.synth(false) << ':' << size << " dta b(0)" << E_;
+	std::cout << std::endl << "*** RUNTIME SCRATCH POOL ***" << std::endl;
+	std::cout << "Pool of " << size << " bytes instead of " << separate << ", saved " << separate - size << " bytes" << std::endl;
+}
 
-	synth_own_functions();
+// Marks the routine, and everything it calls, to be synthesised
+void runtime_base::use(const std::string& routine)
+{
+	if (!used_routines.insert(routine).second)
+	{
+		return;
+	}
+	const auto it = dependencies.find(routine);
+	if (it != dependencies.end())
+	{
+		for (const auto& r : it->second)
+		{
+			use(r);
+		}
+	}
+}
+
+// Only the routines still called, and everything they call, stay marked
+void runtime_base::retain(const std::set<std::string>& referenced)
+{
+	const auto used = used_routines;
+	used_routines.clear();
+	for (const auto& r : used)
+	{
+		if (referenced.count(r))
+		{
+			use(r);
+		}
+	}
+}
+
+int runtime_base::get_scratch_size(const std::string&) const
+{
+	return 0;
+}
+
+bool runtime_base::is_used(const std::string& routine) const
+{
+	return used_routines.find(routine) != used_routines.end();
 }
 
 /*
@@ -89,8 +159,12 @@ PUTCHAR
 	sta ICBLL
 	lda #0
 	sta ICBLL+1
+	txa
+	pha
 	ldx #0
 	jsr CIOV
+	pla
+	tax
 	inc COX
 	#if .byte COX >= AUXBR
 		lda AUXBR
@@ -201,63 +275,31 @@ PUTCOMMA_LABEL_0
 		jmp PUTCOMMA_LABEL_0
 	#end
 	rts
-.var PTABW .byte
-.var AUXBR .byte
-.var COX .byte
-.var AUXBRT .byte
 )";
 }
 
 /*
-Checks if both X and Y registers are 0.
-Returns 1 in accumulator if so.
-*/
-void runtime_base::synth_IsXY00() const
-{
-	synth.synth() << R"(
-IsXY00
-	lda #1
-	cpx #0
-	bne IsXY00_LABEL_0
-	cpy #0
-	bne IsXY00_LABEL_0
-	jmp IsXY00_LABEL_1
-IsXY00_LABEL_0
-	lda #0
-IsXY00_LABEL_1
-	rts
-)";
-}
-
-/*
-Reads 4 bytes from stack and put them in 
-the POKEY registers.
+Reads 4 values from the expression stack
+(voice, pitch, distortion, volume) and put
+them in the POKEY registers.
 */
 void runtime_base::synth_SOUND() const
 {
+	const auto& lo = token(token_provider::TOKENS::EXPRESSION_STACK_LO);
 	synth.synth(false) << "SOUND" << E_;
-	synth.synth() << "mwa #FR0 " << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
-	synth.synth() << "jsr POP_TO" << E_;
-	synth.synth() << "mwa #FR1 " << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
+	synth.synth() << "lda " << lo << "-2,x" << E_;
+	synth.synth() << ":4 asl" << E_;
+	synth.synth() << "eor " << lo << "-1,x" << E_;
+	synth.synth() << "pha" << E_;
+	synth.synth() << "lda " << lo << "-4,x" << E_;
+	synth.synth() << "asl" << E_;
+	synth.synth() << "tay" << E_;
+	synth.synth() << "lda " << lo << "-3,x" << E_;
 	synth.synth() << R"(
-	jsr POP_TO
-	lda FR1
-:4	asl
-	eor FR0
-	tax
-)";
-	synth.synth() << "mwa #FR0 " << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
-	synth.synth() << "jsr POP_TO" << E_;
-	synth.synth() << "mwa #FR1 " << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
-	synth.synth() << R"(
-	jsr POP_TO
-	lda FR1
-	asl
-	tay
-	lda FR0
 	sta AUDF1,y
-	txa
+	pla
 	sta AUDC1,y
+:4	dex
 	rts
 )";
 }
@@ -266,6 +308,8 @@ void runtime_base::synth_POKEY_INIT() const
 {
 	synth.synth() << R"(
 POKEY_INIT
+	txa
+	pha
 	ldx #8
 	lda #0
 	sta SKCTL
@@ -277,184 +321,259 @@ POKEY_INIT_CLEAR
 	lda #3
 	sta SKCTL
 	sta SSKCTL
+	pla
+	tax
 	rts
 )";
 }
 
-void runtime_base::synth_POP_TO() const
-{
-	synth.synth(false) << "POP_TO" << E_;
-
-	synth.synth() << "ldy #0" << E_;
-	synth.synth() << "sbw (" << token(token_provider::TOKENS::PUSH_POP_PTR_TO_INC_DEC) << "),y #" << cfg.get_number_interpretation()->get_size() << E_;
-	synth.synth() << "jsr INIT_PUSH_POP_POINTER" << E_;
-	synth.synth() << "ldy #0" << E_;
-	for (auto j = 0; j < cfg.get_number_interpretation()->get_size(); ++j)
-	{
-		synth.synth() << "lda (" << token(token_provider::TOKENS::PUSH_POP_TARGET_STACK_PTR) << "), y" << E_;
-		synth.synth() << "sta (" << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << "), y" << E_;
-		if(!j)
-		{
-			synth.synth() << "iny" << E_;
-		}
-	}
-
-	synth.synth() << "rts" << E_;
-}
-
-void runtime_base::synth_PEEK_TO() const
+// POKE and DPOKE read the address and the value directly
+// from the expression stack slots and drop both of them
+void runtime_base::synth_POKE() const
 {
-	synth.synth(false) << "PEEK_TO" << E_;
-	synth.synth() << "jsr POP_TO" << E_;
+	const auto& lo = token(token_provider::TOKENS::EXPRESSION_STACK_LO);
+	const auto& hi = token(token_provider::TOKENS::EXPRESSION_STACK_HI);
+	synth.synth(false) << "POKE" << E_;
+	synth.synth() << "lda " << lo << "-2,x" << E_;
+	synth.synth() << "sta FR1" << E_;
+	synth.synth() << "lda " << hi << "-2,x" << E_;
+	synth.synth() << "sta FR1+1" << E_;
 	synth.synth() << "ldy #0" << E_;
-	synth.synth() << "adw (" << token(token_provider::TOKENS::PUSH_POP_PTR_TO_INC_DEC) << "),y #" << cfg.get_number_interpretation()->get_size() << E_;
-
-	synth.synth() << "rts" << E_;
+	synth.synth() << "lda " << lo << "-1,x" << E_;
+	synth.synth() << R"(
+	sta (FR1),y
+	dex
+	dex
+	rts
+)";
 }
 
-void runtime_base::synth_FAKE_POP() const
+void runtime_base::synth_DPOKE() const
 {
-	synth.synth(false) << "FAKE_POP" << E_;
+	const auto& lo = token(token_provider::TOKENS::EXPRESSION_STACK_LO);
+	const auto& hi = token(token_provider::TOKENS::EXPRESSION_STACK_HI);
+	synth.synth(false) << "DPOKE" << E_;
+	synth.synth() << "lda " << lo << "-2,x" << E_;
+	synth.synth() << "sta FR1" << E_;
+	synth.synth() << "lda " << hi << "-2,x" << E_;
+	synth.synth() << "sta FR1+1" << E_;
 	synth.synth() << "ldy #0" << E_;
-	synth.synth() << "sbw (" << token(token_provider::TOKENS::PUSH_POP_PTR_TO_INC_DEC) << "),y #" << cfg.get_number_interpretation()->get_size() << E_;
-	synth.synth() << "rts" << E_;
+	synth.synth() << "lda " << lo << "-1,x" << E_;
+	synth.synth() << "sta (FR1),y" << E_;
+	synth.synth() << "iny" << E_;
+	synth.synth() << "lda " << hi << "-1,x" << E_;
+	synth.synth() << R"(
+	sta (FR1),y
+	dex
+	dex
+	rts
+)";
 }
 
-void runtime_base::synth_INIT_PUSH_POP_POINTER() const
+// PEEK, DPEEK, STICK and STRIG replace the argument
+// on top of the expression stack with the result
+void runtime_base::synth_PEEK() const
 {
-	synth.synth(false) << "INIT_PUSH_POP_POINTER" << E_;
+	const auto& lo = token(token_provider::TOKENS::EXPRESSION_STACK_LO);
+	const auto& hi = token(token_provider::TOKENS::EXPRESSION_STACK_HI);
+	synth.synth(false) << "PEEK" << E_;
+	synth.synth() << "lda " << lo << "-1,x" << E_;
+	synth.synth() << "sta FR0" << E_;
+	synth.synth() << "lda " << hi << "-1,x" << E_;
+	synth.synth() << "sta FR0+1" << E_;
 	synth.synth() << "ldy #0" << E_;
-	synth.synth() << "mwa (" << token(token_provider::TOKENS::PUSH_POP_PTR_TO_INC_DEC) << "),y " << token(token_provider::TOKENS::PUSH_POP_TARGET_STACK_PTR) << E_;
+	synth.synth() << "lda (FR0),y" << E_;
+	synth.synth() << "sta " << lo << "-1,x" << E_;
+	synth.synth() << "tya" << E_;
+	synth.synth() << "sta " << hi << "-1,x" << E_;
 	synth.synth() << "rts" << E_;
 }
 
-void runtime_base::synth_PUSH_FROM() const
+void runtime_base::synth_DPEEK() const
 {
-	synth.synth(false) << "PUSH_FROM" << E_;
-	synth.synth() << "jsr INIT_PUSH_POP_POINTER" << E_;
-	synth.synth() << "ldy #0" << E_;
-	for (auto j = 0; j < cfg.get_number_interpretation()->get_size(); ++j)
-	{
-		synth.synth() << "lda (" << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << "), y" << E_;
-		synth.synth() << "sta (" << token(token_provider::TOKENS::PUSH_POP_TARGET_STACK_PTR) << "), y" << E_;
-		if(!j)
-		{
-			synth.synth() << "iny" << E_;
-		}
-	}
-
+	const auto& lo = token(token_provider::TOKENS::EXPRESSION_STACK_LO);
+	const auto& hi = token(token_provider::TOKENS::EXPRESSION_STACK_HI);
+	synth.synth(false) << "DPEEK" << E_;
+	synth.synth() << "lda " << lo << "-1,x" << E_;
+	synth.synth() << "sta FR0" << E_;
+	synth.synth() << "lda " << hi << "-1,x" << E_;
+	synth.synth() << "sta FR0+1" << E_;
 	synth.synth() << "ldy #0" << E_;
-	synth.synth() << "adw (" << token(token_provider::TOKENS::PUSH_POP_PTR_TO_INC_DEC) << "),y #" << cfg.get_number_interpretation()->get_size() << E_;
+	synth.synth() << "lda (FR0),y" << E_;
+	synth.synth() << "sta " << lo << "-1,x" << E_;
+	synth.synth() << "iny" << E_;
+	synth.synth() << "lda (FR0),y" << E_;
+	synth.synth() << "sta " << hi << "-1,x" << E_;
 	synth.synth() << "rts" << E_;
 }
 
-void runtime_base::synth_POKE() const
+void runtime_base::synth_BLOCK_PARAMETERS() const
 {
-	synth.synth(false) << "POKE" << E_;
-	synth.synth() << "mwa #FR0 " << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
-	synth.synth() << "jsr POP_TO" << E_;
-	synth.synth() << "mwa #FR1 " << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
 	synth.synth() << R"(
-	jsr POP_TO
-	ldy #0
-	lda FR0,y
-	sta (FR1),y
-	rts
+.zpvar BLOCK_SOURCE .word
+.zpvar BLOCK_DESTINATION .word
+.var BLOCK_LENGTH .word
+.var BLOCK_VALUE .word
 )";
 }
 
-void runtime_base::synth_DPOKE() const
+/*
+Fills BLOCK_LENGTH bytes at BLOCK_DESTINATION
+with the word from BLOCK_VALUE. Whole pages
+go first, then the remaining bytes.
+*/
+void runtime_base::synth_BLOCK_FILL() const
 {
-	synth.synth(false) << "DPOKE" << E_;
-	synth.synth() << "mwa #FR0 " << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
-	synth.synth() << "jsr POP_TO" << E_;
-	synth.synth() << "mwa #FR1 " << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
 	synth.synth() << R"(
-	jsr POP_TO
+BLOCK_FILL
 	ldy #0
-	lda FR0,y
-	sta (FR1),y
+	lda BLOCK_LENGTH+1
+	beq BLOCK_FILL_REST
+BLOCK_FILL_PAGE
+	lda BLOCK_VALUE
+	sta (BLOCK_DESTINATION),y
 	iny
-	lda FR0,y
-	sta (FR1),y
-	rts
-)";
-}
-
-void runtime_base::synth_PEEK() const
-{
-	synth.synth(false) << "PEEK" << E_;
-	synth.synth() << "mwa #FR0 " << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
-	synth.synth() << R"(
-	jsr POP_TO
-	ldy #0
-	lda (FR0),y
-	sta FR1,y
-	lda #0
-	sta FR1+1
-)";
-	synth.synth() << "mwa #FR1 " << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
-	synth.synth() << R"(
-	jsr PUSH_FROM
+	lda BLOCK_VALUE+1
+	sta (BLOCK_DESTINATION),y
+	iny
+	bne BLOCK_FILL_PAGE
+	inc BLOCK_DESTINATION+1
+	dec BLOCK_LENGTH+1
+	bne BLOCK_FILL_PAGE
+BLOCK_FILL_REST
+	cpy BLOCK_LENGTH
+	beq BLOCK_FILL_END
+	lda BLOCK_VALUE
+	sta (BLOCK_DESTINATION),y
+	iny
+	cpy BLOCK_LENGTH
+	beq BLOCK_FILL_END
+	lda BLOCK_VALUE+1
+	sta (BLOCK_DESTINATION),y
+	iny
+	bne BLOCK_FILL_REST
+BLOCK_FILL_END
 	rts
 )";
 }
 
-void runtime_base::synth_DPEEK() const
+/*
+Copies BLOCK_LENGTH bytes from BLOCK_SOURCE
+to BLOCK_DESTINATION, starting with the lowest
+address, just like the loop it replaces.
+*/
+void runtime_base::synth_BLOCK_COPY() const
 {
-	synth.synth(false) << "DPEEK" << E_;
-	synth.synth() << "mwa #FR0 " << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
 	synth.synth() << R"(
-	jsr POP_TO
+BLOCK_COPY
 	ldy #0
-	lda (FR0),y
-	sta FR1,y
+	lda BLOCK_LENGTH+1
+	beq BLOCK_COPY_REST
+BLOCK_COPY_PAGE
+	lda (BLOCK_SOURCE),y
+	sta (BLOCK_DESTINATION),y
 	iny
-	lda (FR0),y
-	sta FR1+1
-)";
-	synth.synth() << "mwa #FR1 " << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
-	synth.synth() << R"(
-	jsr PUSH_FROM
+	bne BLOCK_COPY_PAGE
+	inc BLOCK_SOURCE+1
+	inc BLOCK_DESTINATION+1
+	dec BLOCK_LENGTH+1
+	bne BLOCK_COPY_PAGE
+BLOCK_COPY_REST
+	cpy BLOCK_LENGTH
+	beq BLOCK_COPY_END
+	lda (BLOCK_SOURCE),y
+	sta (BLOCK_DESTINATION),y
+	iny
+	bne BLOCK_COPY_REST
+BLOCK_COPY_END
 	rts
 )";
 }
 
 void runtime_base::synth_STICK() const
 {
+	const auto& lo = token(token_provider::TOKENS::EXPRESSION_STACK_LO);
+	const auto& hi = token(token_provider::TOKENS::EXPRESSION_STACK_HI);
 	synth.synth(false) << "STICK" << E_;
-	synth.synth() << "mwa #FR0 " << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
-	synth.synth() << R"(
-	jsr POP_TO
-	ldy FR0
-	lda STICK0,y
-	sta FR1
-	lda #0
-	sta FR1+1
-)";
-	synth.synth() << "mwa #FR1 " << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
-	synth.synth() << R"(
-	jsr PUSH_FROM
-	rts
-)";
+	synth.synth() << "ldy " << lo << "-1,x" << E_;
+	synth.synth() << "lda STICK0,y" << E_;
+	synth.synth() << "sta " << lo << "-1,x" << E_;
+	synth.synth() << "lda #0" << E_;
+	synth.synth() << "sta " << hi << "-1,x" << E_;
+	synth.synth() << "rts" << E_;
 }
 
 void runtime_base::synth_STRIG() const
 {
+	const auto& lo = token(token_provider::TOKENS::EXPRESSION_STACK_LO);
+	const auto& hi = token(token_provider::TOKENS::EXPRESSION_STACK_HI);
 	synth.synth(false) << "STRIG" << E_;
-	synth.synth() << "mwa #FR0 " << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
-	synth.synth() << R"(
-	jsr POP_TO
-	ldy FR0
-	lda STRIG0,y
-	sta FR1
-	lda #0
-	sta FR1+1
-)";
-	synth.synth() << "mwa #FR1 " << token(token_provider::TOKENS::PUSH_POP_VALUE_PTR) << E_;
+	synth.synth() << "ldy " << lo << "-1,x" << E_;
+	synth.synth() << "lda STRIG0,y" << E_;
+	synth.synth() << "sta " << lo << "-1,x" << E_;
+	synth.synth() << "lda #0" << E_;
+	synth.synth() << "sta " << hi << "-1,x" << E_;
+	synth.synth() << "rts" << E_;
+}
+
+/*
+Steps the counter of the FOR loop on top of the frame stack. While the
+counter does not exceed the limit, carry is set and the address to go
+on from is left in FR1. Otherwise the frame is dropped. X is preserved.
+Frame byte k is at FOR_FRAMES+FOR_FRAMES_CAPACITY*k: counter address,
+limit, step and loop address, low byte first.
+*/
+void runtime_base::synth_FOR_NEXT() const
+{
+	const auto& top = token(token_provider::TOKENS::FOR_FRAMES_TOP);
+	const auto field = [this](int k) {
+		return token(token_provider::TOKENS::FOR_FRAMES) + '+' + token(token_provider::TOKENS::FOR_FRAMES_CAPACITY) + '*' + std::to_string(k) + ",x";
+	};
+	synth.synth(false) << "FOR_NEXT" << E_;
+	synth.synth() << "txa" << E_;
+	synth.synth() << "pha" << E_;
+	synth.synth() << "ldx " << top << E_;
+	synth.synth() << "dex" << E_;
+	synth.synth() << "txa" << E_;
+	synth.synth() << "and #" << token(token_provider::TOKENS::FOR_FRAMES_CAPACITY) << "-1" << E_;
+	synth.synth() << "tax" << E_;
+	synth.synth() << "lda " << field(0) << E_;
+	synth.synth() << "sta FR1" << E_;
+	synth.synth() << "lda " << field(1) << E_;
+	synth.synth() << "sta FR1+1" << E_;
+	synth.synth() << "ldy #0" << E_;
+	synth.synth() << "clc" << E_;
+	synth.synth() << "lda (FR1),y" << E_;
+	synth.synth() << "adc " << field(4) << E_;
+	synth.synth() << "sta (FR1),y" << E_;
+	synth.synth() << "iny" << E_;
+	synth.synth() << "lda (FR1),y" << E_;
+	synth.synth() << "adc " << field(5) << E_;
+	synth.synth() << "sta (FR1),y" << E_;
+	synth.synth() << "lda " << field(3) << E_;
+	synth.synth() << "cmp (FR1),y" << E_;
+	synth.synth() << "bne FOR_NEXT_COMPARED" << E_;
+	synth.synth() << "dey" << E_;
+	synth.synth() << "lda " << field(2) << E_;
+	synth.synth() << "cmp (FR1),y" << E_;
+	synth.synth(false) << "FOR_NEXT_COMPARED" << E_;
+	synth.synth() << "bcc FOR_NEXT_DONE" << E_;
+	synth.synth() << "lda " << field(6) << E_;
+	synth.synth() << "sta FR1" << E_;
+	synth.synth() << "lda " << field(7) << E_;
+	synth.synth() << "sta FR1+1" << E_;
+	synth.synth() << "pla" << E_;
+	synth.synth() << "tax" << E_;
+	synth.synth() << "rts" << E_;
+	synth.synth(false) << "FOR_NEXT_DONE" << E_;
+	synth.synth() << "stx " << top << E_;
 	synth.synth() << R"(
-	jsr PUSH_FROM
+	pla
+	tax
+	clc
 	rts
+FOR_NEXT_REPEAT
+	jmp (FR1)
 )";
 }
 
@@ -471,49 +590,14 @@ void runtime_base::synth_own_functions() const
 	}
 }
 
-void runtime_base::synth_CALCULATE_ARRAY_ROW_SIZE_IN_BYTES() const
-{
-	// ARRAY_ASSIGNMENT_TMP_SIZE stores the second index of an array.
-	// We need to multiply it by single number size
-	synth.synth() << R"(
-CALCULATE_ARRAY_ROW_SIZE_IN_BYTES
-	mwa #0 ARRAY_CALCULATION_TMP
-CALCULATE_ARRAY_ROW_SIZE_IN_BYTES_L0
-	#if .word ARRAY_ASSIGNMENT_TMP_SIZE = #0
-		mwa ARRAY_CALCULATION_TMP ARRAY_ASSIGNMENT_TMP_SIZE
-		rts
-	#end
-)";
-	synth.synth() << "adw ARRAY_CALCULATION_TMP #" << cfg.get_number_interpretation()->get_size() << " ARRAY_CALCULATION_TMP" << E_;
-	synth.synth() << R"(
-	dew ARRAY_ASSIGNMENT_TMP_SIZE
-	jmp CALCULATE_ARRAY_ROW_SIZE_IN_BYTES_L0
-	rts
-ARRAY_CALCULATION_TMP dta a(0)
-)";
-}
-
-void runtime_base::synth_INIT_ARRAY_OFFSET() const
-{
-	synth.synth() << R"(
-INIT_ARRAY_OFFSET
-	jsr CALCULATE_ARRAY_ROW_SIZE_IN_BYTES
-INIT_ARRAY_OFFSET_L0
-	#if .word FR0 = #0
-		mwa FR1 ARRAY_ASSIGNMENT_TMP_SIZE
-		jsr CALCULATE_ARRAY_ROW_SIZE_IN_BYTES
-		adw ARRAY_ASSIGNMENT_TMP_ADDRESS ARRAY_ASSIGNMENT_TMP_SIZE ARRAY_ASSIGNMENT_TMP_ADDRESS
-		rts
-	#end
-	adw ARRAY_ASSIGNMENT_TMP_ADDRESS ARRAY_ASSIGNMENT_TMP_SIZE ARRAY_ASSIGNMENT_TMP_ADDRESS
-	dew FR0
-	jmp INIT_ARRAY_OFFSET_L0
-)";
-}
-
 void runtime_base::synth_helpers() const
 {
 	synth.synth(false) << ".zpvar ARRAY_ASSIGNMENT_TMP_ADDRESS .word" << E_;
-	synth.synth(false) << "ARRAY_ASSIGNMENT_TMP_SIZE dta a(0)" << E_;
 	synth.synth(false) << "ARRAY_ASSIGNMENT_TMP_VALUE " << cfg.get_number_interpretation()->get_initializer() << E_;
+
+	// PRINT state, initialized at the program start
+	synth.synth(false) << ".var PTABW .byte" << E_;
+	synth.synth(false) << ".var AUXBR .byte" << E_;
+	synth.synth(false) << ".var COX .byte" << E_;
+	synth.synth(false) << ".var AUXBRT .byte" << E_;
 }
@@ -12,17 +12,48 @@
  */
 
 #include "runtime_integer.h"
+#include "config.h"
 
 runtime_integer::runtime_integer(char endline, synthesizer& _synth, const config& _config)
 	: runtime_base(endline, _synth, _config)
 {
+	dependencies.insert({
+		{ "FASC",				{ "BCDByte2Ascii", "INBUFP_INIT" } },
+		{ "COMPARE_FR0_FR1",	{ "COMPARE_NUMBER", "TRUE_FALSE" } },
+		{ "FR0_boolean_invert",	{ "TRUE_FALSE" } },
+		{ "Is_FR0_true",		{ "TRUE_FALSE" } },
+		{ "LOGICAL_AND",		{ "TRUE_FALSE" } },
+		{ "LOGICAL_OR",			{ "TRUE_FALSE" } } });
+}
+
+int runtime_integer::get_scratch_size(const std::string& routine) const
+{
+	if ("BMUL" == routine)
+	{
+		return (config::MULTIPLICATION::QUARTER_SQUARE == cfg.get_multiplication()) ? 6 : 2;
+	}
+	if ("BDIV" == routine)
+	{
+		return 2;
+	}
+	if ("FASC" == routine)
+	{
+		return 3;
+	}
+	return 0;
 }
 
 void runtime_integer::synth_implementation() const
 {
 	runtime_base::synth_implementation();
-	synth_BCDByte2Ascii();
-	synth_INBUFP_INIT();
+	if (is_used("BCDByte2Ascii"))
+	{
+		synth_BCDByte2Ascii();
+	}
+	if (is_used("INBUFP_INIT"))
+	{
+		synth_INBUFP_INIT();
+	}
 }
 
 // Traverses the LBUFF buffer and sets the
@@ -67,70 +98,176 @@ BCDByte2Ascii
 }
 
 /*
-Adds two numbers located at FR0 and FR1.
-Result is stored in FR0.
+Adds two topmost numbers on the expression stack.
+Result replaces them on the stack.
 */
 void runtime_integer::synth_BADD() const
 {
-	synth.synth() << R"(
-BADD
-	adw FR0 FR1 FR0
-	rts
-)";
+	synth_stack_slots_operation("BADD", "clc", "adc");
 }
 
-
 /*
-Subtracts two numbers located at FR0 and FR1.
-Result is stored in FR0.
+Subtracts two topmost numbers on the expression stack.
+Result replaces them on the stack.
 */
 void runtime_integer::synth_BSUB() const
 {
-	synth.synth() << R"(
-BSUB
-	sbw FR0 FR1 FR0
-	rts
-)";
+	synth_stack_slots_operation("BSUB", "sec", "sbc");
+}
+
+// Synthesises routine that combines two topmost slots of
+// the zero page expression stack byte-by-byte with the given
+// instruction, leaving the result in place of the left operand
+void runtime_integer::synth_stack_slots_operation(const std::string& name, const std::string& prologue, const std::string& instruction) const
+{
+	synth.synth(false) << name << E_;
+	if (!prologue.empty())
+	{
+		synth.synth() << prologue << E_;
+	}
+	for (const auto& bytes : { token(token_provider::TOKENS::EXPRESSION_STACK_LO), token(token_provider::TOKENS::EXPRESSION_STACK_HI) })
+	{
+		synth.synth() << "lda " << bytes << "-2,x" << E_;
+		synth.synth() << instruction << ' ' << bytes << "-1,x" << E_;
+		synth.synth() << "sta " << bytes << "-2,x" << E_;
+	}
+	synth.synth() << "dex" << E_;
+	synth.synth() << "rts" << E_;
 }
 
 /*
 Multiplicates two numbers located at FR0 and FR1.
-Uses accumulation method.
-Consider using this instead: http://codebase64.org/doku.php?id=base:16bit_multiplication_32-bit_product
 Result is stored in FR0.
 */
 void runtime_integer::synth_BMUL() const
+{
+	switch (cfg.get_multiplication())
+	{
+	case config::MULTIPLICATION::QUARTER_SQUARE:
+		synth_BMUL_quarter_square();
+		break;
+	default:
+		synth_BMUL_shift_and_add();
+		break;
+	}
+}
+
+/*
+Shift-and-add multiplication. Always takes 16 iterations,
+only lower 16 bits of the product are kept.
+Inspired by: http://codebase64.org/doku.php?id=base:16bit_multiplication_32-bit_product
+*/
+void runtime_integer::synth_BMUL_shift_and_add() const
 {
 	synth.synth() << R"(
 BMUL
 	lda #0
 	sta BMUL_RES
 	sta BMUL_RES+1
-	ldx FR0
-	ldy FR0+1
-	jsr IsXY00
-	cmp #1
-	beq BMUL_LABEL_0
-	ldx FR1
-	ldy FR1+1
-	jsr IsXY00
-	cmp #1
-	beq BMUL_LABEL_0
-	mwa FR0 BMUL_RES
-BMUL_LABEL_1
-	sbw FR1 #1
-	ldx FR1
-	ldy FR1+1
-	jsr IsXY00
-	cmp #1
-	beq BMUL_LABEL_0
-	adw BMUL_RES FR0 BMUL_RES
-	jmp BMUL_LABEL_1
-BMUL_LABEL_0
+	ldy #16
+BMUL_LOOP
+	asl BMUL_RES
+	rol BMUL_RES+1
+	asl FR1
+	rol FR1+1
+	bcc BMUL_SKIP
+	clc
+	lda BMUL_RES
+	adc FR0
+	sta BMUL_RES
+	lda BMUL_RES+1
+	adc FR0+1
+	sta BMUL_RES+1
+BMUL_SKIP
+	dey
+	bne BMUL_LOOP
 	mwa BMUL_RES FR0
 	rts
-BMUL_RES
-	dta b(0), b(0)
+BMUL_RES equ RUNTIME_SCRATCH
+)";
+}
+
+/*
+Quarter-square multiplication: a*b = f(a+b) - f(|a-b|), where f(x) = x*x/4.
+The 16-bit product is composed of three 8-bit products:
+lo(FR0)*lo(FR1) + ((lo(FR0)*hi(FR1) + hi(FR0)*lo(FR1)) << 8)
+Tables of f(x) for x=0..511 take 1KB, plus up to 255 bytes of padding
+in front of them to align them to a page.
+Inspired by: http://codebase64.org/doku.php?id=base:seriously_fast_multiplication
+*/
+void runtime_integer::synth_BMUL_quarter_square() const
+{
+	synth.synth() << R"(
+BMUL
+	txa
+	pha
+	lda FR0
+	ldy FR1+1
+	jsr BMUL8
+	sta BMUL_RES+1
+	lda FR0+1
+	ldy FR1
+	jsr BMUL8
+	clc
+	adc BMUL_RES+1
+	sta BMUL_RES+1
+	lda FR0
+	ldy FR1
+	jsr BMUL8
+	mva BMUL8_RES FR0
+	lda BMUL8_RES+1
+	clc
+	adc BMUL_RES+1
+	sta FR0+1
+	pla
+	tax
+	rts
+BMUL_RES equ RUNTIME_SCRATCH
+BMUL8_A equ RUNTIME_SCRATCH+2
+BMUL8_B equ RUNTIME_SCRATCH+3
+BMUL8_RES equ RUNTIME_SCRATCH+4
+
+; Multiplies A by Y. Result is stored in BMUL8_RES, its lower byte is also left in A.
+BMUL8
+	sta BMUL8_A
+	sty BMUL8_B
+	sec
+	sbc BMUL8_B
+	bcs BMUL8_LABEL_0
+	eor #$ff
+	adc #1
+BMUL8_LABEL_0
+	tay
+	lda BMUL8_A
+	clc
+	adc BMUL8_B
+	tax
+	bcs BMUL8_LABEL_1
+	sec
+	lda BMUL_SQUARES_LO,x
+	sbc BMUL_SQUARES_LO,y
+	sta BMUL8_RES
+	lda BMUL_SQUARES_HI,x
+	sbc BMUL_SQUARES_HI,y
+	sta BMUL8_RES+1
+	lda BMUL8_RES
+	rts
+BMUL8_LABEL_1
+	sec
+	lda BMUL_SQUARES_LO+$100,x
+	sbc BMUL_SQUARES_LO,y
+	sta BMUL8_RES
+	lda BMUL_SQUARES_HI+$100,x
+	sbc BMUL_SQUARES_HI,y
+	sta BMUL8_RES+1
+	lda BMUL8_RES
+	rts
+
+	.align $100
+BMUL_SQUARES_LO
+:512	dta l(#*#/4)
+BMUL_SQUARES_HI
+:512	dta h(#*#/4)
 )";
 }
 
@@ -144,6 +281,8 @@ void runtime_integer::synth_BDIV() const
 {
 	synth.synth() << R"(
 BDIV
+	txa
+	pha
 	lda #0
 	sta BDIV_REMAINDER
 	sta BDIV_REMAINDER+1
@@ -166,10 +305,11 @@ BDIV_LOOP
 BDIV_SKIP
 	dex
 	bne BDIV_LOOP	
+	pla
+	tax
 	rts
 BDIV_RES EQU FR0
-BDIV_REMAINDER
-	dta a(0)
+BDIV_REMAINDER equ RUNTIME_SCRATCH
 )";
 }
 
@@ -182,6 +322,8 @@ void runtime_integer::synth_FASC() const
 {
 	synth.synth() << R"(
 FASC
+	txa
+	pha
 	lda #0
 	sta FASC_RES+0
 	sta FASC_RES+1
@@ -220,9 +362,10 @@ FASC_LOOP_0
 	ora #%10000000
 	sta (FASC_PTR),y
 	jsr INBUFP_INIT
+	pla
+	tax
 	rts
-FASC_RES
-	dta b(0), b(0), b(0)
+FASC_RES equ RUNTIME_SCRATCH
 .zpvar FASC_PTR .word
 )";
 }
@@ -338,44 +481,17 @@ LOGICAL_OR
 
 void runtime_integer::synth_BINARY_XOR() const
 {
-	synth.synth() << R"(
-BINARY_XOR
-	lda FR0
-	eor FR1
-	sta FR0
-	lda FR0+1
-	eor FR1+1
-	sta FR0+1
-	rts
-)";
+	synth_stack_slots_operation("BINARY_XOR", "", "eor");
 }
 
 void runtime_integer::synth_BINARY_AND() const
 {
-	synth.synth() << R"(
-BINARY_AND
-	lda FR0
-	and FR1
-	sta FR0
-	lda FR0+1
-	and FR1+1
-	sta FR0+1
-	rts
-)";
+	synth_stack_slots_operation("BINARY_AND", "", "and");
 }
 
 void runtime_integer::synth_BINARY_OR() const
 {
-	synth.synth() << R"(
-BINARY_OR
-	lda FR0
-	ora FR1
-	sta FR0
-	lda FR0+1
-	ora FR1+1
-	sta FR0+1
-	rts
-)";
+	synth_stack_slots_operation("BINARY_OR", "", "ora");
 }
 
 void runtime_integer::synth_PUT_ZERO_IN_FR0() const
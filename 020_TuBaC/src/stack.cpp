@@ -13,11 +13,13 @@
 
 #include "stack.h"
 
-stack::stack(const std::string& _name, int _item_size, int _capacity):
+stack::stack(const std::string& _name, const std::string& _low_bytes, const std::string& _high_bytes, int _capacity, int _zero_page_address):
 	name(_name),
-	pointer(_name + "_PTR"),
-	item_size(_item_size),
-	capacity(_capacity)
+	item_size(2),
+	capacity(_capacity),
+	zero_page_address(_zero_page_address),
+	low_bytes(_low_bytes),
+	high_bytes(_high_bytes)
 {}
 
 const std::string& stack::get_name() const
@@ -25,11 +27,6 @@ const std::string& stack::get_name() const
 	return name; 
 }
 
-const std::string& stack::get_pointer() const 
-{ 
-	return pointer; 
-}
-
 int stack::get_capacity() const
 {
 	return capacity;
@@ -39,3 +36,18 @@ int stack::get_item_size() const
 {
 	return item_size;
 }
+
+int stack::get_zero_page_address() const
+{
+	return zero_page_address;
+}
+
+const std::string& stack::get_low_bytes() const
+{
+	return low_bytes;
+}
+
+const std::string& stack::get_high_bytes() const
+{
+	return high_bytes;
+}
@@ -38,6 +38,9 @@
 #ifdef _WIN32
 const std::string linux_test_label = "LINUX_";
 #endif
+// Tests labeled this way use the multiplication tables or get packed
+const std::string table_multiplication_test_label = "TABLE_";
+const std::string packed_test_label = "PACKED_";
 #ifdef _WIN32
 #define CATCH_CONFIG_COLOUR_WINDOWS
 #ifdef NDEBUG
@@ -63,6 +66,8 @@ const std::string test_tmp_source_name = "SOURCE.TXT";		// Uppercase to make Ata
 const std::string test_tmp_source = "tmp/" + test_tmp_source_name;
 const std::string test_tmp_asm = "tmp/source.asm";
 const std::string test_tmp_bin = "tmp/source.xex";
+const std::string test_tmp_packed_asm = "tmp/packed.asm";
+const std::string test_tmp_packed_bin = "tmp/packed.xex";
 const std::string test_tmp_image = "tmp/test.atr";
 
 std::chrono::seconds atari_run_timeout(3);
@@ -125,11 +130,16 @@ std::string parse_atari_listing_test(const std::string& str)
 	return tmp;
 }
 
+bool is_labeled(const bf::path& test, const std::string& label)
+{
+	return test.filename().string().substr(0, label.length()) == label;
+}
+
 // Executes the given TBXL listing on Atari twice.
 // 1. By compiling with Tubac->Mads and running .xex
 // 2. By creating .atr disk and using TBXL to parse the program
 // Returns parsed output from both machines
-std::pair<std::string, std::string> execute_on_atari(std::string test_program)
+std::pair<std::string, std::string> execute_on_atari(std::string test_program, const bf::path& test)
 {
 	try
 	{
@@ -140,6 +150,8 @@ std::pair<std::string, std::string> execute_on_atari(std::string test_program)
 		bf::remove(test_tmp_bin);
 		bf::remove(test_tmp_source);
 		bf::remove(test_tmp_asm);
+		bf::remove(test_tmp_packed_bin);
+		bf::remove(test_tmp_packed_asm);
 
 		// Write test file
 		std::ofstream out(test_tmp_source, std::ios::binary);
@@ -147,13 +159,14 @@ std::pair<std::string, std::string> execute_on_atari(std::string test_program)
 		out << test_program;
 		out.close();
 
-		process_executor pr_tubac(
-			tubac_path,
-			{
-				"--number-type=integer",
-				(boost::format("--output-file=%1%") % test_tmp_asm).str(),
-				test_tmp_source
-			});
+		std::vector<std::string> tubac_arguments = { "--number-type=integer" };
+		if (is_labeled(test, table_multiplication_test_label))
+		{
+			tubac_arguments.push_back("--multiplication=table");
+		}
+		tubac_arguments.push_back((boost::format("--output-file=%1%") % test_tmp_asm).str());
+		tubac_arguments.push_back(test_tmp_source);
+		process_executor pr_tubac(tubac_path, tubac_arguments);
 
 		process_executor pr_mads(
 			mads_path,
@@ -163,11 +176,27 @@ std::pair<std::string, std::string> execute_on_atari(std::string test_program)
 				"-x"
 			});
 
+		const bool packed = is_labeled(test, packed_test_label);
+		process_executor pr_tubac_pack(
+			tubac_path,
+			{
+				"--pack",
+				(boost::format("--output-file=%1%") % test_tmp_packed_asm).str(),
+				test_tmp_bin
+			});
+
+		process_executor pr_mads_pack(
+			mads_path,
+			{
+				test_tmp_packed_asm,
+				(boost::format("-o:%1%") % test_tmp_packed_bin).str(),
+				"-x"
+			});
 
 		process_executor pr_atari_binary(
 			atari_path,
 			{
-				test_tmp_bin,
+				packed ? test_tmp_packed_bin : test_tmp_bin,
 				"-turbo",
 				"-config",
 			   	"tools/atari800/.atari800.cfg"
@@ -224,10 +253,14 @@ std::pair<std::string, std::string> execute_on_atari(std::string test_program)
 #endif
 		std::thread thread_binary_test([&]()
 		{
-			process_group_executor group({
-				&pr_tubac,
-				&pr_mads,
-				&pr_atari_binary });
+			std::vector<process_executor*> binary_test = { &pr_tubac, &pr_mads };
+			if (packed)
+			{
+				binary_test.push_back(&pr_tubac_pack);
+				binary_test.push_back(&pr_mads_pack);
+			}
+			binary_test.push_back(&pr_atari_binary);
+			process_group_executor group(binary_test);
 			result_binary_test = group.run();
 		});
 		std::thread thread_listing_test([&]()
@@ -300,7 +333,7 @@ void remove_linux_specific_tests(std::vector<bf::path>& tests)
 	tests.erase(
 		std::remove_if(tests.begin(), tests.end(),
 			[](auto& p) {
-				return p.filename().string().substr(0, linux_test_label.length()) == linux_test_label;
+				return is_labeled(p, linux_test_label);
 			}), tests.end());
 }
 #endif
@@ -310,7 +343,7 @@ void remove_linux_specific_tests(std::vector<bf::path>& tests)
 		std::string listing = atarize_listing(LISTING); \
 		INFO(listing) \
 		INFO(FILENAME) \
-		result = execute_on_atari(listing); \
+		result = execute_on_atari(listing, FILENAME); \
 		CHECK(result.first == result.second); \
 		}
 